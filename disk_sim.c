@@ -0,0 +1,1740 @@
+/**********************************************************************/
+/*                                                                    */
+/* Program Name: disk_sim - Simulated disk and file system used to    */
+/*                          benchmark the driver without hardware     */
+/*                                                                    */
+/**********************************************************************/
+
+/**********************************************************************/
+/*                                                                    */
+/* This file stands in for the course supplied disk_drive() and       */
+/* send_message() functions. Linked with the driver, it plays both    */
+/* the disk and the file system on a simulated clock. The disk models */
+/* the driver's geometry with seek time per cylinder, rotational      */
+/* latency, motor spin-up time and a transfer rate set by the         */
+/* rotation speed. The file system issues requests from a workload    */
+/* generator, checks every block read back against what was written,  */
+/* and once every request has completed prints a benchmark report     */
+/* and ends the program.                                              */
+/*                                                                    */
+/* With DRIVER_DRIVES set, it also provides disk_drive_unit() and     */
+/* simulates that many disks, mapping blocks onto them just as the    */
+/* driver does. Each disk keeps its own clock, so disks serviced by   */
+/* the driver's worker threads work at the same time, and go on       */
+/* working while the file system handles a message. A message leaves  */
+/* once the requests it completes are done, or once the busy disks    */
+/* finish their last transfers. A disk that gets ahead of another     */
+/* busy disk waits for it, and a disk that sat idle catches up with   */
+/* the file system.                                                   */
+/*                                                                    */
+/* The disks can also inject faults: seeks that miss their cylinder,  */
+/* transfers that fail their checksum, refused DMA setups and bad     */
+/* sectors that never transfer, to check that the driver's retries    */
+/* keep its latency bounded.                                          */
+/*                                                                    */
+/* The replay workload sends the messages of a capture written by     */
+/* the driver's DRIVER_CAPTURE_FILE again, read from a mapped file.   */
+/*                                                                    */
+/*    cc -O2 -pthread -o driver_bench driver.c disk_sim.c -lm         */
+/*    SIM_WORKLOAD=hotspot ./driver_bench                             */
+/*                                                                    */
+/**********************************************************************/
+
+#define _POSIX_C_SOURCE 200809L /* Match the driver's environment     */
+#include <stdio.h>
+#include <stdlib.h>  /* malloc(), exit(), getenv(), qsort()           */
+#include <string.h>  /* memset(), strcmp()                            */
+#include <math.h>    /* fmod(), log()                                 */
+#include <pthread.h> /* pthread_mutex_lock()                          */
+#include <fcntl.h>   /* open()                                        */
+#include <unistd.h>  /* close()                                       */
+#include <sys/stat.h>/* fstat()                                       */
+#include <sys/mman.h>/* mmap(), posix_madvise()                       */
+
+/**********************************************************************/
+/*                         Symbolic Constants                         */
+/**********************************************************************/
+/* These must match the driver                                        */
+#define TRUE                1    /* Constant true value               */
+#define FALSE               0    /* Constant false value              */
+#define MIN_BLOCK_NUMBER    1    /* Minimum allowed block number      */
+#define BYTES_PER_BLOCK     1024 /* Number of bytes per block         */
+#define BYTES_PER_SECTOR    512  /* Number of bytes per sector        */
+#define FS_MESSAGE_COUNT    20   /* File system messages array size   */
+#define MAX_DRIVES          16   /* Most drives the driver runs       */
+#define SENSE_CYLINDER      1    /* Get cylinder of the heads code    */
+#define SEEK_CYLINDER       2    /* Seek to a cylinder code           */
+#define DMA_SETUP           3    /* Set the DMA chip registers code   */
+#define START_MOTOR         4    /* Start the disk motor code         */
+#define MOTOR_STATUS        5    /* Get status of disk motor code     */
+#define READ_DISK           6    /* Read from the disk code           */
+#define WRITE_DISK          7    /* Write from the disk code          */
+#define STOP_MOTOR          8    /* Stop the disk motor code          */
+#define RECALIBRATE         9    /* Recalibrate the disk head code    */
+#define READ_OP_CODE        1    /* Read request operation code       */
+#define WRITE_OP_CODE       2    /* Write request operation code      */
+#define OP_CODE_ERROR       -1   /* Invalid operation code error      */
+#define BLOCK_NUM_ERROR     -4   /* Invalid block number error        */
+#define BLOCK_SIZE_ERROR    -8   /* Invalid block size error          */
+#define DATA_ADDRESS_ERROR  -16  /* Invalid data address error        */
+#define SEEK_FAILED_ERROR   -32  /* Seek retries ran out              */
+#define CHECKSUM_FAILED_ERROR -64
+                                 /* Transfer retries ran out          */
+#define DMA_FAILED_ERROR    -128 /* Disk refused the DMA setup        */
+#define CAPTURE_MESSAGE     0    /* Captured file system message      */
+#define CAPTURE_VERSION     2    /* Version of the capture format     */
+#define DMA_SETUP_ERROR     -1   /* Impossible DMA error from disk    */
+#define CHECKSUM_ERROR      -2   /* Disk controller checksum failed   */
+
+/* Simulator constants                                                */
+#define SECTORS_PER_BLOCK   (BYTES_PER_BLOCK/BYTES_PER_SECTOR)
+                                 /* Number of sectors per block       */
+#define MAX_DISK_BLOCKS     (1<<26)
+                                 /* Most blocks a disk may hold, as   */
+                                 /* in the driver                     */
+#define WORDS_PER_SECTOR    (BYTES_PER_SECTOR/8)
+                                 /* 64 bit words per sector           */
+#define MAX_REQUEST_BLOCKS  4    /* Most blocks a request covers      */
+#define PATTERN_MULTIPLIER  0x9E3779B97F4A7C15ULL
+                                 /* Spreads a sector tag over a       */
+                                 /* sector's data pattern             */
+#define CORRUPT_TAG         ~0ULL/* Tag of a sector written with a    */
+                                 /* damaged data pattern              */
+#define STALL_LIMIT         1000000
+                                 /* Idle messages allowed while the   */
+                                 /* driver holds requests             */
+#define SIM_ALLOC_ERR       10   /* Can't allocate simulator memory   */
+#define SIM_WORKLOAD_ERR    11   /* Unknown workload name             */
+#define SIM_PROTOCOL_ERR    12   /* Driver broke the message protocol */
+#define SIM_GEOMETRY_ERR    13   /* Unknown or impossible geometry    */
+#define SIM_REPLAY_ERR      14   /* Can't map or use the replay trace */
+#define UNIFORM_WORKLOAD    0    /* Blocks chosen uniformly           */
+#define SEQUENTIAL_WORKLOAD 1    /* Streams of consecutive blocks     */
+#define HOTSPOT_WORKLOAD    2    /* Most blocks from a small region   */
+#define BURSTY_WORKLOAD     3    /* Uniform blocks arriving in bursts */
+#define REPLAY_WORKLOAD     4    /* Messages replayed from a capture  */
+
+/**********************************************************************/
+/*                         Program Structures                         */
+/**********************************************************************/
+/* A file system message, which must match the driver's               */
+struct message
+{
+                 int operation_code,  /* Disk operation to perform    */
+                     request_number,  /* Unique request number        */
+                     block_number,    /* Block number to read/write   */
+                     block_size;      /* Block size in bytes          */
+   unsigned long int *p_data_address; /* Points to a block in memory  */
+};
+typedef struct message MESSAGE;
+
+/* The header of a capture file, which must match the driver's        */
+struct capture_header
+{
+                char magic[8];        /* "DRVCAPTR"                   */
+                 int version,         /* Capture file format version  */
+                     record_size;     /* Bytes in each record         */
+};
+typedef struct capture_header CAPTURE_HEADER;
+
+/* A capture file record, which must match the driver's: a message    */
+/* the file system sent, or a disk command and its result             */
+struct capture_record
+{
+           long long time;            /* Time of the event in us      */
+               short kind,            /* Message or disk command      */
+                     unit;            /* Drive commanded, or -1 for a */
+                                      /* message                      */
+                 int code,            /* Operation code, or command   */
+                     args[3],         /* Request number, block number */
+                                      /* and block size, or the       */
+                                      /* command's arguments          */
+                     result,          /* Command's result, or TRUE if */
+                                      /* a message had no data        */
+                                      /* address                      */
+                     exchange;        /* Exchange with the file       */
+                                      /* system a message came in, or */
+                                      /* -1 for a command             */
+};
+typedef struct capture_record CAPTURE_RECORD;
+
+/* A request the simulated file system has sent to the driver         */
+struct sim_request
+{
+                 int operation_code,  /* Disk operation to perform    */
+                     block_number,    /* Block number to read/write   */
+                     block_count,     /* Blocks the request covers    */
+                     versions[MAX_REQUEST_BLOCKS],
+                                      /* Version written to each      */
+                                      /* block, or version a read     */
+                                      /* must return                  */
+                     error_code,      /* Error the driver must return */
+                                      /* for an invalid request       */
+                     outstanding;     /* Waiting on the driver        */
+              double issue_time;      /* Time it was sent, in us      */
+  unsigned long long *p_buffer;       /* Points to its data block     */
+};
+typedef struct sim_request SIM_REQUEST;
+
+/* A disk geometry, which must match the driver's                     */
+struct sim_geometry
+{
+                char *p_name;         /* Name used to select geometry */
+                 int cylinders,       /* Number of cylinders          */
+                     tracks_per_cylinder,
+                                      /* Number of tracks per cylinder*/
+                     sectors_per_track;
+                                      /* Number of sectors per track  */
+};
+typedef struct sim_geometry SIM_GEOMETRY;
+
+/* A sequential workload stream                                       */
+struct sim_stream
+{
+                 int next_block,      /* Next block of the stream     */
+                     remaining,       /* Blocks left in this run      */
+                     operation_code;  /* Operation of this run        */
+};
+typedef struct sim_stream SIM_STREAM;
+
+/* A simulated disk                                                   */
+struct sim_disk
+{
+                 int cylinder,        /* Cylinder the heads are on    */
+                     motor_on,        /* Status of the disk motor     */
+                     dma_sector,      /* DMA starting sector          */
+                     dma_track,       /* DMA starting track           */
+                     dma_size,        /* DMA transfer size in bytes   */
+                     outstanding;     /* Valid requests for its       */
+                                      /* blocks at the driver         */
+  unsigned long long *p_dma_address,  /* Points to DMA memory         */
+                     *p_sector_tags;  /* Tag of every sector's data   */
+              double clock_time,      /* The disk's own time in us    */
+                     transfer_time,   /* Time its last transfer ended */
+                     ready_time,      /* Time the motor is up to speed*/
+                     *p_done_times;   /* Time every sector was last   */
+                                      /* read or written              */
+                long seek_distance,   /* Total cylinders seeked       */
+                     seek_count,      /* Number of seeks              */
+                     spin_up_count,   /* Number of motor spin-ups     */
+                     transfer_count,  /* Number of reads and writes   */
+                     dma_error_count, /* Number of rejected DMA setups*/
+                     seek_fault_count,/* Seeks made to miss           */
+                     checksum_fault_count;
+                                      /* Transfers made to fail their */
+                                      /* checksum                     */
+};
+typedef struct sim_disk SIM_DISK;
+
+/**********************************************************************/
+/*                        Function Prototypes                         */
+/**********************************************************************/
+int disk_drive(int code, int arg1, int arg2, int arg3,
+               unsigned long int *p_arg4);
+   /* Simulates a command to the first disk                           */
+int disk_drive_unit(int unit, int code, int arg1, int arg2, int arg3,
+                    unsigned long int *p_arg4);
+   /* Simulates a command to one of the disks                         */
+void send_message(MESSAGE *p_fs_message);
+   /* Simulates the file system receiving a driver message            */
+long long current_time();
+   /* Gets the simulated time in microseconds for the driver          */
+void sim_initialize();
+   /* Reads the simulator settings and builds the simulated disk      */
+int sim_config(char *p_name, int default_value);
+   /* Gets an integer simulator setting from the environment          */
+void sim_load_geometry(char *p_setting);
+   /* Sets up the simulated disks' geometry from the driver's setting */
+void sim_advance(double microseconds);
+   /* Advances the file system's simulated clock                      */
+int sim_synchronize();
+   /* Brings the file system's clock up to the disks' transfers, and  */
+   /* determines if any disk holds requests                           */
+double sim_done_time(MESSAGE *p_completion);
+   /* Gets the time a completed request's blocks were last transferred*/
+int sim_disk_ahead(SIM_DISK *p_disk);
+   /* Checks whether a disk has run ahead of another busy disk        */
+int sim_command(SIM_DISK *p_disk, int code, int arg1, int arg2,
+                int arg3, unsigned long int *p_arg4);
+   /* Simulates a disk command                                        */
+void sim_wait_for_motor(SIM_DISK *p_disk);
+   /* Waits for a disk motor to come up to speed                      */
+int sim_transfer(SIM_DISK *p_disk, int code);
+   /* Simulates a disk read or write of the DMA area                  */
+SIM_DISK *sim_locate_block(int block_number, int *p_sector);
+   /* Finds the disk and first sector holding a block                 */
+int sim_disk_block(SIM_DISK *p_disk, int sector);
+   /* Gets the number of the block at a sector of a disk              */
+int sim_request_block(SIM_REQUEST *p_request, int block);
+   /* Gets the number of one of the blocks a request covers           */
+int sim_request_blocks(int block_number);
+   /* Picks how many blocks a workload request covers                 */
+int sim_overlap(SIM_REQUEST *p_request);
+   /* Finds a request at the driver that a new request overlaps       */
+void sim_complete(MESSAGE *p_completion);
+   /* Checks and records a request the driver completed               */
+void sim_issue(MESSAGE *p_fs_message);
+   /* Sends the driver every request that has arrived                 */
+void sim_next_request(int *p_operation_code, int *p_block_number);
+   /* Gets the operation and block of the next workload request       */
+void sim_spoil_request(MESSAGE *p_message, SIM_REQUEST *p_request);
+   /* Makes a request invalid in one of the ways the driver checks    */
+double sim_next_arrival();
+   /* Gets the time until the next workload request arrives           */
+void sim_open_replay(char *p_name);
+   /* Maps a capture file into memory to replay its messages          */
+int sim_replay_error();
+   /* Gets the errors the driver finds in the message being replayed  */
+double sim_next_replay();
+   /* Moves on to the next captured message, getting the time until   */
+   /* it is replayed                                                  */
+void fill_sector(unsigned long long *p_sector, unsigned long long tag);
+   /* Fills a sector with the data pattern of a tag                   */
+unsigned long long check_sector(unsigned long long *p_sector);
+   /* Gets the tag of a sector's data pattern                         */
+unsigned long long sim_random();
+   /* Gets a pseudo-random number for the workload                    */
+unsigned long long sim_next_random(unsigned long long *p_state);
+   /* Gets the next pseudo-random number of a sequence                */
+int sim_fault(int percent);
+   /* Decides whether to inject a fault                               */
+int sim_bad_transfer(SIM_DISK *p_disk, int first_sector,
+                     int sector_count);
+   /* Checks whether a transfer covers a bad sector                   */
+void wait_microseconds(long long microseconds);
+   /* Waits for a number of microseconds on the simulated clock       */
+void sim_report();
+   /* Prints the benchmark report and ends the program                */
+int compare_latencies(const void *p_first, const void *p_second);
+   /* Orders latencies for sorting                                    */
+
+/**********************************************************************/
+/*                         Global Variables                           */
+/**********************************************************************/
+SIM_DISK    disks[MAX_DRIVES];        /* The simulated disks          */
+SIM_REQUEST *p_requests;              /* Requests by request number   */
+SIM_STREAM  *p_streams;               /* Sequential workload streams  */
+unsigned long long **p_free_buffers;  /* Stack of free data blocks    */
+double      *p_latencies,             /* Completed request latencies  */
+            clock_time      = 0.0,    /* Simulated time in us         */
+            arrival_time    = 0.0,    /* Next request's arrival time  */
+            first_issue_time= -1.0,   /* Time the first request left  */
+            last_done_time  = 0.0,    /* Time the last request was    */
+                                      /* completed                    */
+            revolution_time,          /* Time per disk revolution     */
+            sector_time;              /* Time per sector under heads  */
+SIM_GEOMETRY disk_geometries[] =      /* Named disk geometries, as    */
+{                                     /* the driver names them        */
+   {"floppy", 40,   2,  9},
+   {"st225",  615,  4,  17},
+   {"large",  4096, 16, 63},
+   {NULL,     0,    0,  0}
+};
+int         cylinders,                /* Number of cylinders          */
+            tracks_per_cylinder,      /* Number of tracks per cylinder*/
+            sectors_per_track,        /* Number of sectors per track  */
+            sectors_per_cylinder,     /* Number of sectors per        */
+                                      /* cylinder                     */
+            disk_blocks;              /* Number of blocks on a disk   */
+int         initialized     = FALSE,  /* Simulator has been set up    */
+            disk_count,               /* Number of disks              */
+            stripe_length,            /* Blocks per stripe, or 0 if   */
+                                      /* the disks are concatenated   */
+            block_count,              /* Blocks across the disks      */
+            workload,                 /* Workload generator in use    */
+            total_requests,           /* Requests to run              */
+            queue_depth,              /* Most requests at the driver  */
+            write_percent,            /* Percent of requests writes   */
+            seek_time,                /* Seek time per cylinder in us */
+            settle_time,              /* Head settle time in us       */
+            spin_up_time,             /* Motor spin-up time in us     */
+            command_time,             /* Controller overhead in us    */
+            idle_time,                /* Time each idle message takes */
+            message_time,             /* Time each message round trip */
+                                      /* takes                        */
+            interarrival_time,        /* Mean time between arrivals   */
+            stream_count,             /* Sequential workload streams  */
+            run_length,               /* Blocks per sequential run    */
+            hot_percent,              /* Percent of hot spot requests */
+            hot_blocks,               /* Size of the hot spot         */
+            burst_size,               /* Requests per burst           */
+            burst_gap,                /* Mean time between bursts     */
+            burst_remaining = 0,      /* Requests left in this burst  */
+            issued_count    = 0,      /* Requests sent to the driver  */
+            completed_count = 0,      /* Requests the driver finished */
+            latency_count   = 0,      /* Valid requests finished      */
+            invalid_percent,          /* Percent of requests invalid  */
+            multi_percent,            /* Percent of requests for      */
+                                      /* several blocks               */
+            invalid_count   = 0,      /* Invalid requests finished    */
+            outstanding     = 0,      /* Requests at the driver       */
+            free_buffer_count,        /* Free data blocks             */
+            data_errors     = 0,      /* Blocks read back wrong       */
+            protocol_errors = 0,      /* Bad completion messages      */
+            stall_count     = 0,      /* Idle messages in a row while */
+                                      /* requests are outstanding     */
+            delivery_count  = 0,      /* Messages carrying completions*/
+            seek_fault_percent,       /* Percent of seeks that miss   */
+            checksum_fault_percent,   /* Percent of transfers that    */
+                                      /* fail their checksum          */
+            dma_fault_percent,        /* Percent of DMA setups        */
+                                      /* refused                      */
+            bad_sector_count,         /* Sectors that always fail     */
+            failed_count    = 0,      /* Valid requests the driver    */
+                                      /* failed                       */
+            *p_written_versions,      /* Newest version of each block */
+            *p_cover_counts,          /* Requests at the driver that  */
+                                      /* cover each block             */
+            *p_cover_starts;          /* First block of the requests  */
+                                      /* that cover each block        */
+long long   *p_bad_sectors;           /* Bad sectors, numbered across */
+                                      /* the disks                    */
+char        *p_failed_writes;         /* A write to the block failed, */
+                                      /* so its version on disk is    */
+                                      /* unknown                      */
+unsigned long long random_state,      /* Workload random number state */
+            fault_state;              /* Fault random number state    */
+char        *workload_names[] =       /* Workload generator names     */
+               {"uniform", "sequential", "hotspot", "bursty", "replay",
+                NULL};
+CAPTURE_RECORD *p_replay_record,      /* Captured message replayed    */
+                                      /* next                         */
+            *p_replay_end;            /* End of the capture file      */
+int         replay_speed;             /* Percent of the captured      */
+                                      /* speed replayed at, or 0 for  */
+                                      /* no gaps                      */
+double      replay_span = 0.0;        /* Time from the first captured */
+                                      /* message to the last          */
+pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+                                      /* Held while the simulator is  */
+                                      /* called from any thread       */
+pthread_cond_t  sim_turn = PTHREAD_COND_INITIALIZER;
+                                      /* Signalled when a disk's clock*/
+                                      /* or requests change           */
+__thread int sim_unit = -1;           /* Disk the calling thread last */
+                                      /* commanded, or -1 for none    */
+
+/**********************************************************************/
+/*               Simulates a command to the first disk                */
+/**********************************************************************/
+int disk_drive(int code, int arg1, int arg2, int arg3,
+               unsigned long int *p_arg4)
+{
+   return disk_drive_unit(0, code, arg1, arg2, arg3, p_arg4);
+}
+
+/**********************************************************************/
+/*   Simulates a command to one of the disks. A disk that has run     */
+/*  ahead of another busy disk waits for it, and a disk that sat idle */
+/*     catches up with the file system's clock before it goes to work */
+/**********************************************************************/
+int disk_drive_unit(int unit, int code, int arg1, int arg2, int arg3,
+                    unsigned long int *p_arg4)
+{
+   SIM_DISK *p_disk; /* Points to the disk commanded                  */
+   int      result;  /* Result of the command                         */
+
+   pthread_mutex_lock(&sim_lock);
+   if (initialized == FALSE)
+      sim_initialize();
+   if (unit < 0 || unit >= disk_count)
+   {
+      protocol_errors += 1;
+      pthread_mutex_unlock(&sim_lock);
+      return -1;
+   }
+   sim_unit = unit;
+   p_disk   = &disks[unit];
+   while (sim_disk_ahead(p_disk) == TRUE)
+      pthread_cond_wait(&sim_turn, &sim_lock);
+   if (p_disk->outstanding == 0 && p_disk->clock_time < clock_time)
+      p_disk->clock_time = clock_time;
+   result = sim_command(p_disk, code, arg1, arg2, arg3, p_arg4);
+   pthread_cond_broadcast(&sim_turn);
+   pthread_mutex_unlock(&sim_lock);
+   return result;
+}
+
+/**********************************************************************/
+/*                       Simulates a disk command                     */
+/**********************************************************************/
+int sim_command(SIM_DISK *p_disk, int code, int arg1, int arg2,
+                int arg3, unsigned long int *p_arg4)
+{
+   int distance; /* Cylinders a seek moves the heads                  */
+
+   /* Every command costs the controller some time                    */
+   p_disk->clock_time += command_time;
+   switch (code)
+   {
+      case SENSE_CYLINDER:
+         return p_disk->cylinder;
+
+      case SEEK_CYLINDER:
+      case RECALIBRATE:
+         if (code == RECALIBRATE)
+            arg1 = 0;
+         if (arg1 < 0 || arg1 >= cylinders)
+            return p_disk->cylinder;
+         sim_wait_for_motor(p_disk);
+         if (code == SEEK_CYLINDER && cylinders > 1 &&
+             sim_fault(seek_fault_percent) == TRUE)
+         {
+            arg1 += arg1 > 0 ? -1 : 1;
+            p_disk->seek_fault_count += 1;
+         }
+         distance = abs(arg1 - p_disk->cylinder);
+         if (distance > 0)
+         {
+            p_disk->clock_time += (double)distance * seek_time +
+                                  settle_time;
+            p_disk->seek_distance += distance;
+            p_disk->seek_count    += 1;
+         }
+         p_disk->cylinder = arg1;
+         return p_disk->cylinder;
+
+      case DMA_SETUP:
+         if (arg1 < 0 || arg1 >= sectors_per_track ||
+             arg2 < 0 || arg2 >= tracks_per_cylinder ||
+             arg3 <= 0 || arg3 % BYTES_PER_SECTOR != 0 ||
+             arg2 * sectors_per_track + arg1 + arg3 / BYTES_PER_SECTOR >
+                sectors_per_cylinder ||
+             p_arg4 == NULL || sim_fault(dma_fault_percent) == TRUE)
+         {
+            p_disk->dma_size         = 0;
+            p_disk->dma_error_count += 1;
+            return DMA_SETUP_ERROR;
+         }
+         p_disk->dma_sector    = arg1;
+         p_disk->dma_track     = arg2;
+         p_disk->dma_size      = arg3;
+         p_disk->p_dma_address = (unsigned long long *)p_arg4;
+         return 0;
+
+      case START_MOTOR:
+         if (p_disk->motor_on == FALSE)
+         {
+            p_disk->motor_on       = TRUE;
+            p_disk->ready_time     = p_disk->clock_time + spin_up_time;
+            p_disk->spin_up_count += 1;
+         }
+         return TRUE;
+
+      case MOTOR_STATUS:
+         sim_wait_for_motor(p_disk);
+         return p_disk->motor_on;
+
+      case READ_DISK:
+      case WRITE_DISK:
+         return sim_transfer(p_disk, code);
+
+      case STOP_MOTOR:
+         p_disk->motor_on = FALSE;
+         return FALSE;
+   }
+   return -1;
+}
+
+/**********************************************************************/
+/*         Simulates the file system receiving a driver message       */
+/**********************************************************************/
+void send_message(MESSAGE *p_fs_message)
+{
+   int    message;    /* Index of a completion message                */
+   double last_time,  /* File system's time before the message        */
+          done_time;  /* Time a completed request was done            */
+
+   pthread_mutex_lock(&sim_lock);
+   if (initialized == FALSE)
+      sim_initialize();
+
+   /* Record the completed requests, which end at the first message   */
+   /* with a zero request number. The message leaves once the last of */
+   /* them is done, and costs the file system a round trip            */
+   last_time = clock_time;
+   if (p_fs_message[0].request_number != 0)
+   {
+      for (message = 0; message < FS_MESSAGE_COUNT &&
+                        p_fs_message[message].request_number != 0;
+           message++)
+         if ((done_time = sim_done_time(&p_fs_message[message])) >
+                                                             clock_time)
+            clock_time = done_time;
+      sim_advance(message_time);
+      stall_count    = 0;
+      delivery_count += 1;
+      for (message = 0; message < FS_MESSAGE_COUNT &&
+                        p_fs_message[message].request_number != 0;
+           message++)
+         sim_complete(&p_fs_message[message]);
+   }
+
+   /* An idle message leaves once the disks holding requests have     */
+   /* finished their last transfers, and only picks up the requests   */
+   /* that arrived meanwhile. The driver has stalled only if those    */
+   /* disks make no progress. With every disk idle, time passes       */
+   else if (sim_synchronize() == TRUE)
+   {
+      sim_advance(message_time);
+      if (clock_time > last_time + message_time)
+         stall_count = 0;
+      else if ((stall_count += 1) > STALL_LIMIT)
+      {
+         printf("\nError #%d in send_message().", SIM_PROTOCOL_ERR);
+         printf("\nThe driver is idle with %d requests outstanding.",
+                outstanding);
+         printf("\nThe program is aborting.");
+         exit(SIM_PROTOCOL_ERR);
+      }
+   }
+   else
+   {
+      sim_advance(message_time);
+      if (outstanding > 0 && (stall_count += 1) > STALL_LIMIT)
+      {
+         printf("\nError #%d in send_message().", SIM_PROTOCOL_ERR);
+         printf("\nThe driver is idle with %d requests outstanding.",
+                outstanding);
+         printf("\nThe program is aborting.");
+         exit(SIM_PROTOCOL_ERR);
+      }
+      if (arrival_time > clock_time)
+         sim_advance(arrival_time - clock_time < idle_time ?
+                     arrival_time - clock_time : idle_time);
+   }
+
+   /* Finish the benchmark once every request has completed           */
+   if (completed_count == total_requests)
+      sim_report();
+
+   /* Send the driver the requests that have arrived. A thread that   */
+   /* also commands a disk could not have done so meanwhile           */
+   sim_issue(p_fs_message);
+   if (sim_unit >= 0 && disks[sim_unit].clock_time < clock_time)
+      disks[sim_unit].clock_time = clock_time;
+   pthread_cond_broadcast(&sim_turn);
+   pthread_mutex_unlock(&sim_lock);
+   return;
+}
+
+/**********************************************************************/
+/*  Gets the simulated time in microseconds, replacing the driver's   */
+/*   real time clock. A thread commanding a disk sees that disk's     */
+/*    time, unless the file system's clock has already passed it      */
+/**********************************************************************/
+long long current_time()
+{
+   double now; /* Simulated time seen by the calling thread           */
+
+   pthread_mutex_lock(&sim_lock);
+   now = clock_time;
+   if (sim_unit >= 0 && disks[sim_unit].clock_time > now)
+      now = disks[sim_unit].clock_time;
+   pthread_mutex_unlock(&sim_lock);
+   return (long long)now;
+}
+
+/**********************************************************************/
+/*    Reads the simulator settings and builds the simulated disk      */
+/**********************************************************************/
+void sim_initialize()
+{
+   char     *p_name = getenv("SIM_WORKLOAD"); /* Workload name        */
+   SIM_DISK *p_disk;                          /* Points to a disk     */
+   int      index;                            /* Index of a table     */
+                                              /* entry                */
+
+   /* Look up the workload generator                                  */
+   workload = UNIFORM_WORKLOAD;
+   if (p_name != NULL && *p_name != '\0')
+   {
+      while (workload_names[workload] != NULL &&
+             strcmp(workload_names[workload], p_name) != 0)
+         workload += 1;
+      if (workload_names[workload] == NULL)
+      {
+         printf("\nError #%d in sim_initialize().", SIM_WORKLOAD_ERR);
+         printf("\nUnknown workload \"%s\".", p_name);
+         printf("\nThe program is aborting.");
+         exit(SIM_WORKLOAD_ERR);
+      }
+   }
+
+   /* Build the disks to the driver's geometry, and lay the blocks    */
+   /* out on them the way the driver's settings have it map them      */
+   sim_load_geometry(getenv("DISK_GEOMETRY"));
+   disk_count    = sim_config("DRIVER_DRIVES", 1);
+   stripe_length = sim_config("DRIVER_STRIPE_BLOCKS",
+                              sectors_per_cylinder / SECTORS_PER_BLOCK);
+   disk_count    = disk_count < 1 ? 1 : disk_count > MAX_DRIVES ?
+                                            MAX_DRIVES : disk_count;
+   stripe_length = stripe_length < 0 || disk_count == 1 ? 0 :
+                   stripe_length > disk_blocks ? disk_blocks :
+                                                         stripe_length;
+   if (stripe_length == 0)
+      block_count = disk_count * disk_blocks;
+   else
+      block_count = disk_count * stripe_length *
+                    (disk_blocks / stripe_length);
+
+   /* Read the workload and disk timing settings                      */
+   total_requests    = sim_config("SIM_REQUESTS",          10000);
+   queue_depth       = sim_config("SIM_QUEUE_DEPTH",       32);
+   write_percent     = sim_config("SIM_WRITE_PERCENT",     30);
+   interarrival_time = sim_config("SIM_INTERARRIVAL_US",   25000);
+   stream_count      = sim_config("SIM_STREAMS",           4);
+   run_length        = sim_config("SIM_RUN_LENGTH",        64);
+   hot_percent       = sim_config("SIM_HOT_PERCENT",       80);
+   hot_blocks        = sim_config("SIM_HOT_BLOCKS", block_count / 10);
+   burst_size        = sim_config("SIM_BURST_SIZE",        16);
+   burst_gap         = sim_config("SIM_BURST_GAP_US",      400000);
+   seek_time         = sim_config("SIM_SEEK_US",           1000);
+   settle_time       = sim_config("SIM_SETTLE_US",         2000);
+   spin_up_time      = sim_config("SIM_SPIN_UP_US",        1000000);
+   command_time      = sim_config("SIM_COMMAND_US",        50);
+   idle_time         = sim_config("SIM_IDLE_US",           5000);
+   message_time      = sim_config("SIM_MESSAGE_US",        0);
+   invalid_percent   = sim_config("SIM_INVALID_PERCENT",   0);
+   multi_percent     = sim_config("SIM_MULTI_BLOCK_PERCENT", 0);
+   replay_speed      = sim_config("SIM_REPLAY_SPEED",      100);
+   revolution_time   = 60000000.0 / sim_config("SIM_RPM",  3600);
+   sector_time       = revolution_time / sectors_per_track;
+
+   /* Read the fault injection settings, and seed the workload's and  */
+   /* the faults' random numbers                                      */
+   seek_fault_percent     = sim_config("SIM_SEEK_FAULT_PERCENT",     0);
+   checksum_fault_percent = sim_config("SIM_CHECKSUM_FAULT_PERCENT", 0);
+   dma_fault_percent      = sim_config("SIM_DMA_FAULT_PERCENT",      0);
+   bad_sector_count       = sim_config("SIM_BAD_SECTORS",            0);
+   random_state      = (unsigned long long)sim_config("SIM_SEED", 1) *
+                       PATTERN_MULTIPLIER + 1;
+   fault_state       = random_state ^ PATTERN_MULTIPLIER;
+   if (workload == REPLAY_WORKLOAD)
+      sim_open_replay(getenv("SIM_REPLAY_FILE"));
+   if (queue_depth < 1)
+      queue_depth = 1;
+   if (hot_blocks < 1 || hot_blocks > block_count)
+      hot_blocks = block_count;
+   if (stream_count < 1)
+      stream_count = 1;
+   if (invalid_percent > 99)
+      invalid_percent = 99;
+   if (multi_percent < 0)
+      multi_percent = 0;
+   if (bad_sector_count < 0)
+      bad_sector_count = 0;
+
+   /* Allocate the file system's bookkeeping and the disk's contents  */
+   p_requests           = (SIM_REQUEST *)calloc(total_requests + 1,
+                                                sizeof(SIM_REQUEST));
+   p_latencies          = (double *)malloc(total_requests *
+                                           sizeof(double));
+   p_streams            = (SIM_STREAM *)calloc(stream_count,
+                                               sizeof(SIM_STREAM));
+   p_free_buffers       = (unsigned long long **)malloc(queue_depth *
+                                 sizeof(unsigned long long *));
+   p_written_versions   = (int *)calloc(block_count + 1,
+                                        sizeof(int));
+   p_cover_counts       = (int *)calloc(block_count + 1,
+                                        sizeof(int));
+   p_cover_starts       = (int *)calloc(block_count + 1,
+                                        sizeof(int));
+   p_failed_writes      = (char *)calloc(block_count + 1, sizeof(char));
+   p_bad_sectors        = (long long *)malloc((bad_sector_count + 1) *
+                                              sizeof(long long));
+   if (p_requests == NULL || p_latencies == NULL || p_streams == NULL ||
+       p_free_buffers == NULL || p_written_versions == NULL ||
+       p_cover_counts == NULL || p_cover_starts == NULL ||
+       p_failed_writes == NULL || p_bad_sectors == NULL)
+   {
+      printf("\nError #%d in sim_initialize().", SIM_ALLOC_ERR);
+      printf("\nCannot allocate enough memory for the simulator.");
+      printf("\nThe program is aborting.");
+      exit(SIM_ALLOC_ERR);
+   }
+   for (index = 0; index < queue_depth; index++)
+      if ((p_free_buffers[index] = (unsigned long long *)malloc(
+                        MAX_REQUEST_BLOCKS * BYTES_PER_BLOCK)) == NULL)
+      {
+         printf("\nError #%d in sim_initialize().", SIM_ALLOC_ERR);
+         printf("\nCannot allocate enough memory for data blocks.");
+         printf("\nThe program is aborting.");
+         exit(SIM_ALLOC_ERR);
+      }
+   free_buffer_count = queue_depth;
+
+   /* Pick the bad sectors from all the disks' sectors                */
+   for (index = 0; index < bad_sector_count; index++)
+      p_bad_sectors[index] = (long long)(sim_next_random(&fault_state) %
+                             ((unsigned long long)disk_count *
+                              cylinders * sectors_per_cylinder));
+
+   /* Start every disk blank, with its heads parked and its motor     */
+   /* stopped                                                         */
+   for (p_disk = disks; p_disk < disks + disk_count; p_disk++)
+   {
+      p_disk->p_sector_tags = (unsigned long long *)calloc(
+                                 (long)cylinders * sectors_per_cylinder,
+                                 sizeof(unsigned long long));
+      p_disk->p_done_times  = (double *)calloc(
+                                 (long)cylinders * sectors_per_cylinder,
+                                 sizeof(double));
+      if (p_disk->p_sector_tags == NULL || p_disk->p_done_times == NULL)
+      {
+         printf("\nError #%d in sim_initialize().", SIM_ALLOC_ERR);
+         printf("\nCannot allocate enough memory for the disks.");
+         printf("\nThe program is aborting.");
+         exit(SIM_ALLOC_ERR);
+      }
+      p_disk->cylinder = 0;
+      p_disk->motor_on = FALSE;
+      p_disk->dma_size = 0;
+   }
+   initialized = TRUE;
+   return;
+}
+
+/**********************************************************************/
+/*   Sets up the simulated disks' geometry from the driver's setting, */
+/*    which names a geometry or gives its cylinders, tracks and       */
+/*      sectors per track, with the course's disk by default          */
+/**********************************************************************/
+void sim_load_geometry(char *p_setting)
+{
+   SIM_GEOMETRY *p_named = disk_geometries;
+                         /* Points to a named geometry                */
+
+   if (p_setting == NULL || *p_setting == '\0')
+      p_setting = disk_geometries[0].p_name;
+   while (p_named->p_name != NULL &&
+          strcmp(p_named->p_name, p_setting) != 0)
+      p_named += 1;
+   if (p_named->p_name != NULL)
+   {
+      cylinders           = p_named->cylinders;
+      tracks_per_cylinder = p_named->tracks_per_cylinder;
+      sectors_per_track   = p_named->sectors_per_track;
+   }
+   else if (sscanf(p_setting, "%dx%dx%d", &cylinders,
+                   &tracks_per_cylinder, &sectors_per_track) != 3)
+      cylinders = 0;
+   if (cylinders < 1 || tracks_per_cylinder < 1 ||
+       sectors_per_track < 1 ||
+       (long long)tracks_per_cylinder * sectors_per_track %
+                                               SECTORS_PER_BLOCK != 0 ||
+       (long long)tracks_per_cylinder * sectors_per_track /
+          SECTORS_PER_BLOCK * cylinders > MAX_DISK_BLOCKS)
+   {
+      printf("\nError #%d in sim_load_geometry().", SIM_GEOMETRY_ERR);
+      printf("\nUnknown or impossible disk geometry \"%s\".",
+             p_setting);
+      printf("\nThe program is aborting.");
+      exit(SIM_GEOMETRY_ERR);
+   }
+   sectors_per_cylinder = tracks_per_cylinder * sectors_per_track;
+   disk_blocks          = cylinders * sectors_per_cylinder /
+                          SECTORS_PER_BLOCK;
+   return;
+}
+
+/**********************************************************************/
+/*   Gets an integer simulator setting from the environment, or the   */
+/*             default value if the setting is not set                */
+/**********************************************************************/
+int sim_config(char *p_name, int default_value)
+{
+   char *p_value = getenv(p_name); /* Points to the setting's text    */
+
+   if (p_value == NULL || *p_value == '\0')
+      return default_value;
+   return atoi(p_value);
+}
+
+/**********************************************************************/
+/*                   Advances the simulated clock                     */
+/**********************************************************************/
+void sim_advance(double microseconds)
+{
+   clock_time += microseconds;
+   return;
+}
+
+/**********************************************************************/
+/*  Brings the file system's clock up to the end of the last transfer */
+/*  of the slowest disk that still holds requests, since it must wait */
+/*    for that disk anyway, and determines if there was such a disk   */
+/**********************************************************************/
+int sim_synchronize()
+{
+   SIM_DISK *p_disk;      /* Points to a disk                         */
+   double   slowest = -1; /* Last transfer of the slowest busy disk   */
+
+   for (p_disk = disks; p_disk < disks + disk_count; p_disk++)
+      if (p_disk->outstanding > 0 &&
+          (slowest < 0 || p_disk->transfer_time < slowest))
+         slowest = p_disk->transfer_time;
+   if (slowest > clock_time)
+      clock_time = slowest;
+   return slowest >= 0;
+}
+
+/**********************************************************************/
+/*   Checks whether a disk has run ahead of another disk that still   */
+/*  holds requests. Letting only the disk furthest behind go on keeps */
+/*    the disks from doing work at a time the file system has yet to  */
+/*                     send them requests for                         */
+/**********************************************************************/
+int sim_disk_ahead(SIM_DISK *p_disk)
+{
+   SIM_DISK *p_other; /* Points to another disk                       */
+
+   for (p_other = disks; p_other < disks + disk_count; p_other++)
+      if (p_other != p_disk && p_other->outstanding > 0 &&
+          p_other->clock_time < p_disk->clock_time)
+         return TRUE;
+   return FALSE;
+}
+
+/**********************************************************************/
+/*            Waits for a disk motor to come up to speed              */
+/**********************************************************************/
+void sim_wait_for_motor(SIM_DISK *p_disk)
+{
+   /* A stopped motor is spun up first, just as the hardware would    */
+   if (p_disk->motor_on == FALSE)
+      sim_command(p_disk, START_MOTOR, 0, 0, 0, NULL);
+   if (p_disk->ready_time > p_disk->clock_time)
+      p_disk->clock_time = p_disk->ready_time;
+   return;
+}
+
+/**********************************************************************/
+/*          Simulates a disk read or write of the DMA area            */
+/**********************************************************************/
+int sim_transfer(SIM_DISK *p_disk, int code)
+{
+   int                sector,          /* Sector being transferred    */
+                      sector_count,    /* Sectors in the transfer     */
+                      first_sector;    /* Index of its first sector   */
+   unsigned long long *p_tag,          /* Points to a sector's tag    */
+                      checksum = 0;    /* Sum of the sector tags      */
+   double             position;        /* Sector under the heads      */
+
+   if (p_disk->dma_size == 0)
+      return CHECKSUM_ERROR;
+   sim_wait_for_motor(p_disk);
+
+   /* Wait for the first sector to rotate under the heads, then pass  */
+   /* every sector of the transfer under them                         */
+   position = fmod(p_disk->clock_time, revolution_time) / sector_time;
+   p_disk->clock_time += fmod(p_disk->dma_sector - position +
+                              sectors_per_track, sectors_per_track) *
+                         sector_time;
+   sector_count = p_disk->dma_size / BYTES_PER_SECTOR;
+   p_disk->clock_time     += sector_count * sector_time;
+   p_disk->transfer_count += 1;
+   first_sector = p_disk->cylinder * sectors_per_cylinder +
+                  p_disk->dma_track * sectors_per_track +
+                  p_disk->dma_sector;
+
+   /* A transfer over a bad sector, or one picked to fail, moves no   */
+   /* data and fails its checksum                                     */
+   if (sim_bad_transfer(p_disk, first_sector, sector_count) == TRUE ||
+       sim_fault(checksum_fault_percent) == TRUE)
+   {
+      for (sector = 0; sector < sector_count; sector++)
+         p_disk->p_done_times[first_sector + sector] =
+                                                    p_disk->clock_time;
+      p_disk->transfer_time         = p_disk->clock_time;
+      p_disk->checksum_fault_count += 1;
+      return CHECKSUM_ERROR;
+   }
+
+   /* Move the data between the disk and memory, noting when each     */
+   /* sector was done                                                 */
+   p_tag        = p_disk->p_sector_tags + first_sector;
+   for (sector = 0; sector < sector_count; sector++)
+   {
+      if (code == READ_DISK)
+         fill_sector(p_disk->p_dma_address + sector * WORDS_PER_SECTOR,
+                     p_tag[sector]);
+      else
+         p_tag[sector] = check_sector(p_disk->p_dma_address +
+                                      sector * WORDS_PER_SECTOR);
+      checksum += p_tag[sector];
+      p_disk->p_done_times[first_sector + sector] = p_disk->clock_time;
+   }
+   p_disk->transfer_time = p_disk->clock_time;
+   return (int)(checksum & 0x7FFFFFFF);
+}
+
+/**********************************************************************/
+/*   Finds the disk and first sector holding a block, mapping blocks  */
+/*                onto the disks just as the driver does              */
+/**********************************************************************/
+SIM_DISK *sim_locate_block(int block_number, int *p_sector)
+{
+   int index = block_number - MIN_BLOCK_NUMBER,
+             /* Index of the block across the disks                   */
+       stripe;
+             /* Index of the block's stripe                           */
+
+   if (stripe_length == 0)
+   {
+      *p_sector = index % disk_blocks * SECTORS_PER_BLOCK;
+      return &disks[index / disk_blocks];
+   }
+   stripe    = index / stripe_length;
+   *p_sector = (stripe / disk_count * stripe_length +
+                index % stripe_length) * SECTORS_PER_BLOCK;
+   return &disks[stripe % disk_count];
+}
+
+/**********************************************************************/
+/*    Gets the number of the block at a sector of a disk, undoing     */
+/*                          sim_locate_block()                        */
+/**********************************************************************/
+int sim_disk_block(SIM_DISK *p_disk, int sector)
+{
+   int index = sector / SECTORS_PER_BLOCK,
+             /* Index of the block on its disk                        */
+       disk  = p_disk - disks;
+             /* Index of the disk                                     */
+
+   if (stripe_length == 0)
+      return disk * disk_blocks + index + MIN_BLOCK_NUMBER;
+   return (index / stripe_length * disk_count + disk) * stripe_length +
+          index % stripe_length + MIN_BLOCK_NUMBER;
+}
+
+/**********************************************************************/
+/*  Gets the number of one of the blocks a request covers. A request  */
+/*  for several blocks covers those that follow its first one on its  */
+/*          disk, which a stripe may number far apart                 */
+/**********************************************************************/
+int sim_request_block(SIM_REQUEST *p_request, int block)
+{
+   SIM_DISK *p_disk; /* Points to the disk holding the request        */
+   int      sector;  /* First sector of the request                   */
+
+   p_disk = sim_locate_block(p_request->block_number, &sector);
+   return sim_disk_block(p_disk, sector + block * SECTORS_PER_BLOCK);
+}
+
+/**********************************************************************/
+/*         Checks and records a request the driver completed          */
+/**********************************************************************/
+void sim_complete(MESSAGE *p_completion)
+{
+   SIM_REQUEST        *p_request;   /* Points to completed request    */
+   SIM_DISK           *p_disk;      /* Points to the block's disk     */
+   unsigned long long tag;          /* Tag of a sector read back      */
+   int                block,        /* Index of a block the request   */
+                                    /* covers                         */
+                      block_number, /* Number of that block           */
+                      half,         /* Sector of the block            */
+                      version = 0,  /* Version of the block read back */
+                      half_version, /* Version of one sector          */
+                      sector;       /* First sector of the block      */
+
+   /* Make sure the driver is completing a request it was sent        */
+   if (p_completion->request_number < 1 ||
+       p_completion->request_number > issued_count ||
+       p_requests[p_completion->request_number].outstanding == FALSE)
+   {
+      protocol_errors += 1;
+      return;
+   }
+   p_request = &p_requests[p_completion->request_number];
+
+   /* An invalid request must come back with the errors it was sent   */
+   /* with                                                            */
+   if (p_request->error_code != 0)
+   {
+      if (p_completion->operation_code != p_request->error_code)
+         protocol_errors += 1;
+      invalid_count += 1;
+   }
+
+   /* A valid request may come back failed once the driver's retries  */
+   /* ran out, and a failed write leaves the block's version on the   */
+   /* disk unknown                                                    */
+   else if (p_completion->operation_code == SEEK_FAILED_ERROR ||
+            p_completion->operation_code == CHECKSUM_FAILED_ERROR ||
+            p_completion->operation_code == DMA_FAILED_ERROR)
+   {
+      failed_count += 1;
+      if (p_request->operation_code == WRITE_OP_CODE)
+         for (block = 0; block < p_request->block_count; block++)
+            p_failed_writes[sim_request_block(p_request, block)] = TRUE;
+   }
+
+   /* A block's requests all start at the same block, so the driver   */
+   /* keeps them in arrival order and a read must return the version  */
+   /* of each block written last before the read was sent             */
+   else if (p_request->operation_code == READ_OP_CODE)
+   {
+      if (p_completion->operation_code != 0)
+         data_errors += 1;
+      else
+         for (block = 0; block < p_request->block_count; block++)
+         {
+            block_number = sim_request_block(p_request, block);
+            for (half = 0; half < SECTORS_PER_BLOCK; half++)
+            {
+               tag = check_sector(p_request->p_buffer +
+                                  (block * SECTORS_PER_BLOCK + half) *
+                                  WORDS_PER_SECTOR);
+               if (tag == 0)
+                  half_version = 0;
+               else if (tag != CORRUPT_TAG &&
+                        (int)(tag >> 32) == block_number &&
+                        (int)(tag & 1) == half % 2)
+                  half_version = (int)((tag >> 1) & 0x7FFFFFFF);
+               else
+                  half_version = -1;
+               if (half == 0 || half_version != version)
+                  version = half == 0 ? half_version : -1;
+            }
+            if (p_failed_writes[block_number] == FALSE ?
+                   version != p_request->versions[block] :
+                   version > p_written_versions[block_number])
+            {
+               data_errors += 1;
+               break;
+            }
+         }
+   }
+
+   /* Record a valid request's latency, and free its data block and   */
+   /* the blocks it covers                                            */
+   if (p_request->error_code == 0)
+   {
+      for (block = 0; block < p_request->block_count; block++)
+         p_cover_counts[sim_request_block(p_request, block)] -= 1;
+      p_disk = sim_locate_block(p_request->block_number, &sector);
+      p_disk->outstanding -= 1;
+      p_latencies[latency_count++] = clock_time - p_request->issue_time;
+   }
+   last_done_time = clock_time;
+   completed_count   += 1;
+   outstanding       -= 1;
+   p_request->outstanding = FALSE;
+   p_free_buffers[free_buffer_count++] = p_request->p_buffer;
+   return;
+}
+
+/**********************************************************************/
+/*  Gets the time a completed request's blocks last passed under the  */
+/*   heads, which a disk running ahead of the file system's clock may */
+/*      have made later than now, or 0 if the request is invalid      */
+/**********************************************************************/
+double sim_done_time(MESSAGE *p_completion)
+{
+   SIM_REQUEST *p_request;      /* Points to the completed request    */
+   SIM_DISK    *p_disk;         /* Points to the block's disk         */
+   int         sector,          /* First sector of the request        */
+               index;           /* Index of a sector of the request   */
+   double      done_time = 0.0; /* Time the blocks were transferred   */
+
+   if (p_completion->request_number < 1 ||
+       p_completion->request_number > issued_count)
+      return 0.0;
+   p_request = &p_requests[p_completion->request_number];
+   if (p_request->outstanding == FALSE || p_request->error_code != 0)
+      return 0.0;
+   p_disk = sim_locate_block(p_request->block_number, &sector);
+   for (index = 0; index < p_request->block_count * SECTORS_PER_BLOCK;
+        index++)
+      if (p_disk->p_done_times[sector + index] > done_time)
+         done_time = p_disk->p_done_times[sector + index];
+   return done_time;
+}
+
+/**********************************************************************/
+/*  Sends the driver every request that has arrived. A replay sends   */
+/*   one captured exchange at a time, so the driver takes its         */
+/*             messages in together, as it did when captured          */
+/**********************************************************************/
+void sim_issue(MESSAGE *p_fs_message)
+{
+   SIM_REQUEST *p_request;    /* Points to the request being sent     */
+   SIM_DISK    *p_disk;       /* Points to the disk holding its block */
+   int         message = 0,   /* Index of the message being filled    */
+               exchange = 0,  /* Captured exchange being replayed     */
+               block,         /* Index of a block the request covers  */
+               block_number,  /* Number of that block                 */
+               overlap,       /* First block of a request overlapped  */
+               half,          /* Sector of the block                  */
+               invalid;       /* The request is to be sent invalid    */
+
+   while (message < FS_MESSAGE_COUNT && issued_count < total_requests &&
+          outstanding < queue_depth && arrival_time <= clock_time &&
+          (workload != REPLAY_WORKLOAD || message == 0 ||
+           p_replay_record->exchange == exchange))
+   {
+      /* Build the next workload request                              */
+      issued_count += 1;
+      outstanding  += 1;
+      p_request = &p_requests[issued_count];
+      p_request->outstanding = TRUE;
+      p_request->error_code  = 0;
+      p_request->issue_time  = clock_time;
+      p_request->p_buffer    = p_free_buffers[--free_buffer_count];
+      if (first_issue_time < 0.0)
+         first_issue_time = clock_time;
+      if (workload == REPLAY_WORKLOAD)
+      {
+         p_request->operation_code = p_replay_record->code;
+         p_request->block_number   = p_replay_record->args[1];
+         invalid  = sim_replay_error() != 0;
+         exchange = p_replay_record->exchange;
+      }
+      else
+      {
+         sim_next_request(&p_request->operation_code,
+                          &p_request->block_number);
+         invalid = invalid_percent > 0 &&
+                   (int)(sim_random() % 100) < invalid_percent;
+      }
+      p_request->block_count = 1;
+      if (invalid == FALSE && workload != REPLAY_WORKLOAD &&
+          multi_percent > 0)
+      {
+         p_request->block_count =
+            sim_request_blocks(p_request->block_number);
+
+         /* The driver keeps only requests starting at the same block */
+         /* in order, so a request never overlaps one at the driver   */
+         /* that starts at another block. It shrinks to its first     */
+         /* block, or failing that moves to the first block of the    */
+         /* request it overlaps                                       */
+         if (sim_overlap(p_request) != 0)
+            p_request->block_count = 1;
+         if ((overlap = sim_overlap(p_request)) != 0)
+            p_request->block_number = overlap;
+      }
+
+      /* Writes carry each block's next version; reads start out with */
+      /* garbage and remember the oldest version they may return of   */
+      /* each block, the newest one written before them. An invalid   */
+      /* request never touches the disk, so it has no version         */
+      memset(p_request->p_buffer, 0xA5,
+             p_request->block_count * BYTES_PER_BLOCK);
+      if (invalid == FALSE)
+         for (block = 0; block < p_request->block_count; block++)
+         {
+            block_number = sim_request_block(p_request, block);
+            p_cover_counts[block_number] += 1;
+            p_cover_starts[block_number]  = p_request->block_number;
+            if (p_request->operation_code == READ_OP_CODE)
+               p_request->versions[block] =
+                  p_written_versions[block_number];
+            else
+            {
+               p_request->versions[block] =
+                  (p_written_versions[block_number] += 1);
+               for (half = 0; half < SECTORS_PER_BLOCK; half++)
+                  fill_sector(p_request->p_buffer +
+                                 (block * SECTORS_PER_BLOCK + half) *
+                                 WORDS_PER_SECTOR,
+                              ((unsigned long long)block_number << 32) |
+                              ((unsigned long long)
+                                  p_request->versions[block] << 1) |
+                              (half % 2));
+            }
+         }
+
+      /* Hand the request to the driver                               */
+      p_fs_message[message].operation_code = p_request->operation_code;
+      p_fs_message[message].request_number = issued_count;
+      p_fs_message[message].block_number   = p_request->block_number;
+      p_fs_message[message].block_size     =
+         p_request->block_count * BYTES_PER_BLOCK;
+      p_fs_message[message].p_data_address =
+         (unsigned long int *)p_request->p_buffer;
+      if (invalid == TRUE)
+         sim_spoil_request(&p_fs_message[message], p_request);
+      else
+      {
+         p_disk = sim_locate_block(p_request->block_number, &half);
+         if (p_disk->outstanding == 0 &&
+             p_disk->clock_time < clock_time)
+            p_disk->clock_time = clock_time;
+         p_disk->outstanding += 1;
+      }
+      message      += 1;
+      arrival_time += workload == REPLAY_WORKLOAD ? sim_next_replay() :
+                                                    sim_next_arrival();
+   }
+   if (message < FS_MESSAGE_COUNT)
+      p_fs_message[message].operation_code = 0;
+   return;
+}
+
+/**********************************************************************/
+/*   Makes a request invalid in one of the ways the driver checks,    */
+/*            recording the error the driver must return              */
+/**********************************************************************/
+void sim_spoil_request(MESSAGE *p_message, SIM_REQUEST *p_request)
+{
+   /* A replayed message is sent just as invalid as it was captured   */
+   if (workload == REPLAY_WORKLOAD)
+   {
+      p_message->operation_code = p_replay_record->code;
+      p_message->block_number   = p_replay_record->args[1];
+      p_message->block_size     = p_replay_record->args[2];
+      if (p_replay_record->result == TRUE)
+         p_message->p_data_address = NULL;
+      p_request->error_code     = sim_replay_error();
+      return;
+   }
+
+   switch (sim_random() % 4)
+   {
+      case 0:
+         p_message->operation_code = WRITE_OP_CODE + 1;
+         p_request->error_code     = OP_CODE_ERROR;
+         break;
+
+      case 1:
+         p_message->block_number   = block_count + 1 +
+                                     (int)(sim_random() % 1000);
+         p_request->error_code     = BLOCK_NUM_ERROR;
+         break;
+
+      case 2:
+         p_message->block_size     = BYTES_PER_BLOCK - 1;
+         p_request->error_code     = BLOCK_SIZE_ERROR;
+         break;
+
+      default:
+         p_message->p_data_address = NULL;
+         p_request->error_code     = DATA_ADDRESS_ERROR;
+         break;
+   }
+   return;
+}
+
+/**********************************************************************/
+/*      Gets the operation and block of the next workload request     */
+/**********************************************************************/
+void sim_next_request(int *p_operation_code, int *p_block_number)
+{
+   SIM_STREAM *p_stream; /* Points to a sequential workload stream    */
+
+   *p_operation_code = (int)(sim_random() % 100) < write_percent ?
+                       WRITE_OP_CODE : READ_OP_CODE;
+   switch (workload)
+   {
+      case SEQUENTIAL_WORKLOAD:
+         /* Continue one of the streams, starting a new run when it   */
+         /* ends or falls off the end of the disk                     */
+         p_stream = &p_streams[sim_random() % stream_count];
+         if (p_stream->remaining <= 0 ||
+             p_stream->next_block > block_count)
+         {
+            p_stream->next_block     = MIN_BLOCK_NUMBER +
+                                       sim_random() % block_count;
+            p_stream->remaining      = run_length;
+            p_stream->operation_code = *p_operation_code;
+         }
+         *p_operation_code  = p_stream->operation_code;
+         *p_block_number    = p_stream->next_block++;
+         p_stream->remaining -= 1;
+         break;
+
+      case HOTSPOT_WORKLOAD:
+         if ((int)(sim_random() % 100) < hot_percent)
+            *p_block_number = MIN_BLOCK_NUMBER +
+                              sim_random() % hot_blocks;
+         else
+            *p_block_number = MIN_BLOCK_NUMBER +
+                              sim_random() % block_count;
+         break;
+
+      default:
+         *p_block_number = MIN_BLOCK_NUMBER +
+                           sim_random() % block_count;
+         break;
+   }
+   return;
+}
+
+/**********************************************************************/
+/*  Picks how many blocks a workload request covers: one, or for the  */
+/*  share of multiple block requests two or four, as many as fit on   */
+/*    the rest of the first block's cylinder and the disk's blocks    */
+/**********************************************************************/
+int sim_request_blocks(int block_number)
+{
+   int sector,   /* First sector of the block on its disk             */
+       index,    /* Index of the block on its disk                    */
+       cylinder_blocks = sectors_per_cylinder / SECTORS_PER_BLOCK,
+                 /* Blocks on a cylinder                              */
+       count;    /* Blocks the request covers                         */
+
+   if ((int)(sim_random() % 100) >= multi_percent)
+      return 1;
+   sim_locate_block(block_number, &sector);
+   index = sector / SECTORS_PER_BLOCK;
+   count = 2 << (sim_random() % 2);
+   while (count > 1 &&
+          (index % cylinder_blocks + count > cylinder_blocks ||
+           index + count > block_count / disk_count))
+      count /= 2;
+   return count;
+}
+
+/**********************************************************************/
+/*   Finds a request at the driver that covers a block a new request  */
+/*   covers but starts at another block, getting its first block, or  */
+/*                            0 if none does                          */
+/**********************************************************************/
+int sim_overlap(SIM_REQUEST *p_request)
+{
+   int block,        /* Index of a block the request covers           */
+       block_number; /* Number of that block                          */
+
+   for (block = 0; block < p_request->block_count; block++)
+   {
+      block_number = sim_request_block(p_request, block);
+      if (p_cover_counts[block_number] > 0 &&
+          p_cover_starts[block_number] != p_request->block_number)
+         return p_cover_starts[block_number];
+   }
+   return 0;
+}
+
+/**********************************************************************/
+/*     Gets the time until the next workload request arrives, drawn   */
+/*             from an exponential (Poisson arrival) spread           */
+/**********************************************************************/
+double sim_next_arrival()
+{
+   double uniform = ((sim_random() >> 11) + 1.0) / 9007199254740993.0;
+                    /* Uniform random number in (0, 1]                */
+
+   if (workload == BURSTY_WORKLOAD)
+   {
+      if (burst_remaining > 1)
+      {
+         burst_remaining -= 1;
+         return 0.0;
+      }
+      burst_remaining = burst_size;
+      return -log(uniform) * burst_gap;
+   }
+   return -log(uniform) * interarrival_time;
+}
+
+/**********************************************************************/
+/*  Maps a capture file into memory to replay the messages in it. A   */
+/*  replay sends each captured exchange on the simulated clock, and   */
+/*  sends as many requests as there are messages. The disk commands   */
+/*  captured with them are skipped, as the simulated disks answer the */
+/*                         driver's own commands                      */
+/**********************************************************************/
+void sim_open_replay(char *p_name)
+{
+   int            file;       /* Descriptor of the capture file       */
+   struct stat    status;     /* Size of the capture file             */
+   char           *p_map;     /* Points to the mapped capture file    */
+   CAPTURE_HEADER *p_header;  /* Points to the file's header          */
+   CAPTURE_RECORD *p_record,  /* Points to a captured record          */
+                  *p_last = NULL;
+                              /* Points to the last captured message  */
+   int            write_count = 0;
+                              /* Captured writes                      */
+
+   /* Map the whole capture file read only                            */
+   if (p_name == NULL || *p_name == '\0' ||
+       (file = open(p_name, O_RDONLY)) < 0)
+   {
+      printf("\nError #%d in sim_open_replay().", SIM_REPLAY_ERR);
+      printf("\nCannot open the replay trace \"%s\".",
+             p_name == NULL ? "" : p_name);
+      printf("\nThe program is aborting.");
+      exit(SIM_REPLAY_ERR);
+   }
+   if (fstat(file, &status) != 0 ||
+       status.st_size < (off_t)sizeof(CAPTURE_HEADER) ||
+       (p_map = (char *)mmap(NULL, status.st_size, PROT_READ,
+                             MAP_PRIVATE, file, 0)) == MAP_FAILED)
+   {
+      printf("\nError #%d in sim_open_replay().", SIM_REPLAY_ERR);
+      printf("\nCannot map the replay trace \"%s\".", p_name);
+      printf("\nThe program is aborting.");
+      exit(SIM_REPLAY_ERR);
+   }
+   close(file);
+   posix_madvise(p_map, status.st_size, POSIX_MADV_SEQUENTIAL);
+
+   /* Check that it is a capture this simulator can read              */
+   p_header        = (CAPTURE_HEADER *)p_map;
+   p_replay_record = (CAPTURE_RECORD *)(p_map + sizeof(CAPTURE_HEADER));
+   p_replay_end    = p_replay_record + (status.st_size -
+                     sizeof(CAPTURE_HEADER)) / sizeof(CAPTURE_RECORD);
+   if (memcmp(p_header->magic, "DRVCAPTR", sizeof(p_header->magic)) !=
+                                                                    0 ||
+       p_header->version     != CAPTURE_VERSION ||
+       p_header->record_size != sizeof(CAPTURE_RECORD))
+   {
+      printf("\nError #%d in sim_open_replay().", SIM_REPLAY_ERR);
+      printf("\n\"%s\" is not a capture file this simulator reads.",
+             p_name);
+      printf("\nThe program is aborting.");
+      exit(SIM_REPLAY_ERR);
+   }
+
+   /* Count the captured messages and writes, and start at the first  */
+   /* message                                                         */
+   total_requests = 0;
+   for (p_record = p_replay_end - 1; p_record >= p_replay_record;
+        p_record--)
+      if (p_record->kind == CAPTURE_MESSAGE)
+      {
+         if (p_last == NULL)
+            p_last = p_record;
+         total_requests += 1;
+         if (p_record->code == WRITE_OP_CODE)
+            write_count += 1;
+      }
+   while (p_replay_record < p_replay_end &&
+          p_replay_record->kind != CAPTURE_MESSAGE)
+      p_replay_record += 1;
+   if (total_requests == 0)
+   {
+      printf("\nError #%d in sim_open_replay().", SIM_REPLAY_ERR);
+      printf("\nThe replay trace \"%s\" holds no messages.", p_name);
+      printf("\nThe program is aborting.");
+      exit(SIM_REPLAY_ERR);
+   }
+   replay_span   = (double)(p_last->time - p_replay_record->time);
+   write_percent = write_count * 100 / total_requests;
+   return;
+}
+
+/**********************************************************************/
+/*  Gets the errors the driver finds in the message being replayed,   */
+/*  checked as the driver checks them, against this run's disks. The  */
+/*      simulator numbers the requests itself, so those are valid     */
+/**********************************************************************/
+int sim_replay_error()
+{
+   CAPTURE_RECORD *p_record = p_replay_record;
+                              /* Points to the captured message       */
+   int            error_code = 0;
+                              /* Errors found in the message          */
+
+   if (p_record->code != READ_OP_CODE &&
+       p_record->code != WRITE_OP_CODE)
+      error_code += OP_CODE_ERROR;
+   if (p_record->args[1] < MIN_BLOCK_NUMBER ||
+       p_record->args[1] > block_count)
+      error_code += BLOCK_NUM_ERROR;
+   if (p_record->args[2] <= 0 ||
+       p_record->args[2] > sectors_per_cylinder * BYTES_PER_SECTOR ||
+       (p_record->args[2] & (p_record->args[2] - 1)) != 0)
+      error_code += BLOCK_SIZE_ERROR;
+   if (p_record->result == TRUE)
+      error_code += DATA_ADDRESS_ERROR;
+   return error_code;
+}
+
+/**********************************************************************/
+/*  Moves on to the next captured message, and gets the time until it */
+/*  is replayed: the captured gap between exchanges scaled to the     */
+/*  replay speed, or no gap at a speed of 0. Messages that came in    */
+/*              together have no gap between them                     */
+/**********************************************************************/
+double sim_next_replay()
+{
+   CAPTURE_RECORD *p_previous = p_replay_record;
+                                /* Points to the message just replayed*/
+
+   do
+      p_replay_record += 1;
+   while (p_replay_record < p_replay_end &&
+          p_replay_record->kind != CAPTURE_MESSAGE);
+   if (p_replay_record == p_replay_end || replay_speed <= 0 ||
+       p_replay_record->exchange == p_previous->exchange)
+      return 0.0;
+   return (p_replay_record->time - p_previous->time) * 100.0 /
+          replay_speed;
+}
+
+/**********************************************************************/
+/*              Fills a sector with the data pattern of a tag         */
+/**********************************************************************/
+void fill_sector(unsigned long long *p_sector, unsigned long long tag)
+{
+   int word; /* Index of a word in the sector                         */
+
+   if (tag == 0)
+      memset(p_sector, 0, BYTES_PER_SECTOR);
+   else
+   {
+      p_sector[0] = tag;
+      for (word = 1; word < WORDS_PER_SECTOR; word++)
+         p_sector[word] = (tag * PATTERN_MULTIPLIER) ^ word;
+   }
+   return;
+}
+
+/**********************************************************************/
+/*  Gets the tag of a sector's data pattern, which is 0 for a never   */
+/*       written (zeroed) sector and CORRUPT_TAG for a bad pattern    */
+/**********************************************************************/
+unsigned long long check_sector(unsigned long long *p_sector)
+{
+   int word; /* Index of a word in the sector                         */
+
+   for (word = 1; word < WORDS_PER_SECTOR; word++)
+      if (p_sector[word] != (p_sector[0] == 0 ? 0 :
+                             (p_sector[0] * PATTERN_MULTIPLIER) ^ word))
+         return CORRUPT_TAG;
+   return p_sector[0];
+}
+
+/**********************************************************************/
+/*               Gets a pseudo-random number for the workload         */
+/**********************************************************************/
+unsigned long long sim_random()
+{
+   return sim_next_random(&random_state);
+}
+
+/**********************************************************************/
+/*    Gets the next pseudo-random number of a sequence (xorshift64*)  */
+/**********************************************************************/
+unsigned long long sim_next_random(unsigned long long *p_state)
+{
+   *p_state ^= *p_state >> 12;
+   *p_state ^= *p_state << 25;
+   *p_state ^= *p_state >> 27;
+   return *p_state * 2685821657736338717ULL;
+}
+
+/**********************************************************************/
+/*  Decides whether to inject a fault that happens a percent of the   */
+/*  time. Faults draw on their own sequence, so injecting them leaves */
+/*                     the workload unchanged                         */
+/**********************************************************************/
+int sim_fault(int percent)
+{
+   return percent > 0 &&
+          (int)(sim_next_random(&fault_state) % 100) < percent;
+}
+
+/**********************************************************************/
+/*       Checks whether a transfer covers one of the bad sectors      */
+/**********************************************************************/
+int sim_bad_transfer(SIM_DISK *p_disk, int first_sector,
+                     int sector_count)
+{
+   long long first = (long long)(p_disk - disks) * cylinders *
+                     sectors_per_cylinder + first_sector;
+                     /* First sector numbered across the disks        */
+   int       index;  /* Index of a bad sector                         */
+
+   for (index = 0; index < bad_sector_count; index++)
+      if (p_bad_sectors[index] >= first &&
+          p_bad_sectors[index] < first + sector_count)
+         return TRUE;
+   return FALSE;
+}
+
+/**********************************************************************/
+/*  Waits for a number of microseconds on the clock of the disk the   */
+/*    calling thread last commanded, or on the file system's clock    */
+/**********************************************************************/
+void wait_microseconds(long long microseconds)
+{
+   pthread_mutex_lock(&sim_lock);
+   if (sim_unit >= 0)
+      disks[sim_unit].clock_time += microseconds;
+   else
+      clock_time += microseconds;
+   pthread_cond_broadcast(&sim_turn);
+   pthread_mutex_unlock(&sim_lock);
+   return;
+}
+
+/**********************************************************************/
+/*         Prints the benchmark report and ends the program           */
+/**********************************************************************/
+void sim_report()
+{
+   SIM_DISK *p_disk;  /* Points to a disk                             */
+   SIM_DISK totals;   /* Statistics summed over the disks             */
+   double   elapsed = (last_done_time - first_issue_time) / 1000000.0,
+                      /* Seconds from first request to last completion*/
+            total   = 0.0;
+                      /* Sum of the request latencies                 */
+   int      index;    /* Index of a latency                           */
+
+   /* Sum the disk statistics                                         */
+   memset(&totals, 0, sizeof(totals));
+   for (p_disk = disks; p_disk < disks + disk_count; p_disk++)
+   {
+      totals.seek_distance        += p_disk->seek_distance;
+      totals.seek_count           += p_disk->seek_count;
+      totals.transfer_count       += p_disk->transfer_count;
+      totals.spin_up_count        += p_disk->spin_up_count;
+      totals.dma_error_count      += p_disk->dma_error_count;
+      totals.seek_fault_count     += p_disk->seek_fault_count;
+      totals.checksum_fault_count += p_disk->checksum_fault_count;
+   }
+
+   /* Sort the latencies to find the percentiles                      */
+   qsort(p_latencies, latency_count, sizeof(double),
+         compare_latencies);
+   for (index = 0; index < latency_count; index++)
+      total += p_latencies[index];
+
+   printf("Workload:          %s, %d requests, %d%% writes\n",
+          workload_names[workload], completed_count, write_percent);
+   if (workload == REPLAY_WORKLOAD)
+      printf("Replay:            %.3f s captured, at %d%% speed\n",
+             replay_span / 1000000.0, replay_speed);
+   printf("Elapsed time:      %.3f s\n", elapsed);
+   printf("Throughput:        %.2f requests/s\n",
+          elapsed > 0.0 ? completed_count / elapsed : 0.0);
+   printf("Latency mean:      %.3f ms\n",
+          total / latency_count / 1000.0);
+   printf("Latency p50:       %.3f ms\n",
+          p_latencies[(latency_count - 1) / 2] / 1000.0);
+   printf("Latency p99:       %.3f ms\n",
+          p_latencies[(latency_count - 1) * 99 / 100] / 1000.0);
+   printf("Latency max:       %.3f ms\n",
+          p_latencies[latency_count - 1] / 1000.0);
+   printf("Invalid requests:  %d\n", invalid_count);
+   printf("Drives:            %d, %d blocks\n", disk_count,
+          block_count);
+   printf("Seek distance:     %ld cylinders in %ld seeks\n",
+          totals.seek_distance, totals.seek_count);
+   printf("Disk transfers:    %ld\n", totals.transfer_count);
+   printf("Completion msgs:   %d\n", delivery_count);
+   printf("Motor spin-ups:    %ld\n", totals.spin_up_count);
+   printf("DMA setup errors:  %ld\n", totals.dma_error_count);
+   printf("Injected faults:   %ld missed seeks, %ld checksum errors\n",
+          totals.seek_fault_count, totals.checksum_fault_count);
+   printf("Failed requests:   %d\n", failed_count);
+   printf("Data errors:       %d\n", data_errors);
+   printf("Protocol errors:   %d\n", protocol_errors);
+   fflush(stdout);
+   exit(data_errors == 0 && protocol_errors == 0 ? 0 : 1);
+}
+
+/**********************************************************************/
+/*                  Orders latencies for sorting                      */
+/**********************************************************************/
+int compare_latencies(const void *p_first, const void *p_second)
+{
+   double first  = *(const double *)p_first,  /* First latency        */
+          second = *(const double *)p_second; /* Second latency       */
+
+   return (first > second) - (first < second);
+}
@@ -38,8 +38,20 @@
 /*                                                                    */
 /**********************************************************************/
 
+#define _POSIX_C_SOURCE 200809L /* posix_memalign(), pthreads         */
 #include <stdio.h>
-#include <stdlib.h>  /* malloc(), free(), exit()                      */
+#include <stdlib.h>  /* malloc(), free(), exit(), getenv(), atexit()  */
+#include <string.h>  /* strcmp(), memcpy()                            */
+#include <time.h>    /* clock_gettime()                               */
+#include <pthread.h> /* pthread_create(), mutexes, condition vars     */
+
+/**********************************************************************/
+/*  Building with DRIVER_METRICS defined, as in cc -DDRIVER_METRICS,  */
+/*  adds request lifecycle tracing, histograms of latency and seek    */
+/*  distance, queue depth sampling, metrics snapshots and a binary    */
+/*  trace file. Without it none of that code is compiled, and only    */
+/*             the driver's plain counters are kept                   */
+/**********************************************************************/
 
 /**********************************************************************/
 /*                         Symbolic Constants                         */
@@ -48,19 +60,55 @@
 #define FALSE               0    /* Constant false value              */
 #define MIN_REQUEST_NUMBER  1    /* Minimum allowed request number    */
 #define MIN_BLOCK_NUMBER    1    /* Minimum allowed block number      */
-#define MAX_BLOCK_NUMBER    360  /* Maximum allowed block number      */
-#define LIST_HEADER         MIN_BLOCK_NUMBER-1
-                                 /* Pending request list header       */
-#define LIST_TRAILER        MAX_BLOCK_NUMBER+1
-                                 /* Pending request list trailer      */
-#define HEADER_ALLOC_ERR    1    /* Can't allocate header memory      */
-#define TRAILER_ALLOC_ERR   2    /* Can't allocate trailer memory     */
+#define MAX_DISK_BLOCKS     (1<<26)
+                                 /* Most blocks a drive may hold      */
+#define BITS_PER_WORD       64   /* Number of bits in a bitmap word   */
+#define MAX_MAP_LEVELS      6    /* Levels of occupancy map, enough   */
+                                 /* for any number of slots           */
+#define QUEUE_ALLOC_ERR     1    /* Can't allocate queue memory       */
+#define POOL_ALLOC_ERR      2    /* Can't allocate request pool       */
 #define REQUEST_ALLOC_ERR   3    /* Can't allocate request memory     */
+#define SCHEDULER_ERR       4    /* Unknown scheduling policy name    */
+#define CACHE_ALLOC_ERR     5    /* Can't allocate block cache memory */
+#define CACHE_POLICY_ERR    6    /* Unknown cache eviction policy     */
+#define LRU_EVICTION        0    /* Evict the least recently used     */
+#define CLOCK_EVICTION      1    /* Evict by the CLOCK algorithm      */
+#define NO_ENTRY            -1   /* No block cache entry              */
+#define MOTOR_POLICY_ERR    7    /* Unknown motor policy name         */
+#define DRIVE_ALLOC_ERR     8    /* Can't allocate a drive, its track */
+                                 /* buffers or its worker thread      */
+#define DRIVE_UNIT_ERR      9    /* Several drives but no interface   */
+                                 /* to address them                   */
+#define GEOMETRY_ERR        10   /* Unknown or impossible geometry    */
+#define METRICS_ERR         11   /* Unknown metrics format, or can't  */
+                                 /* open a metrics or trace file      */
+#define CAPTURE_ERR         12   /* Can't open the capture file       */
+#define MAX_DRIVES          16   /* Most drives the driver runs       */
+#define IDLE_HISTORY        32   /* Idle periods the adaptive motor   */
+                                 /* policy remembers                  */
+#define NOT_IDLE            -1   /* No idle period under way          */
+#define SYNC_PRIORITY       0    /* Reads the file system waits on    */
+#define METADATA_PRIORITY   1    /* Writes to the metadata blocks     */
+#define BACKGROUND_PRIORITY 2    /* All other writes                  */
+#define PRIORITY_CLASSES    3    /* Number of request priorities      */
+#define READ_STREAMS        8    /* Sequential read streams followed  */
+#define TRACK_BUFFERS       4    /* Cylinders kept in track buffers   */
+#define SEQUENTIAL_LENGTH   2    /* Blocks read in order before a     */
+                                 /* stream is read ahead              */
+#define BUFFER_EMPTY        0    /* Track buffer block not held       */
+#define BUFFER_READ         1    /* Track buffer block asked for      */
+#define BUFFER_PREFETCHED   2    /* Track buffer block read ahead and */
+                                 /* not yet asked for                 */
+#define MAX_PENDING_REQUESTS 1024
+                                 /* Pending queue limit, which sizes  */
+                                 /* the request pool                  */
+#define CACHE_LINE_SIZE     64   /* Bytes per processor cache line    */
 #define BYTES_PER_BLOCK     1024 /* Number of bytes per block         */
 #define BYTES_PER_SECTOR    512  /* Number of bytes per sector        */
-#define CYLINDERS           40   /* Number of cylinders               */
-#define SECTORS_PER_TRACK   9    /* Number of sectors per track       */
-#define TRACKS_PER_CYLINDER 2    /* Number of tracks per cylinder     */
+#define SECTORS_PER_BLOCK   (BYTES_PER_BLOCK/BYTES_PER_SECTOR)
+                                 /* Number of sectors per block       */
+#define DIVIDEND_BITS       31   /* Bits in the numbers a DIVISOR     */
+                                 /* divides                           */
 #define FS_MESSAGE_COUNT    20   /* File system messages array size   */
 #define SENSE_CYLINDER      1    /* Get cylinder of the heads code    */
 #define SEEK_CYLINDER       2    /* Seek to a cylinder code           */
@@ -76,10 +124,28 @@
 #define BLOCK_NUM_ERROR     -4   /* Invalid block number error        */
 #define BLOCK_SIZE_ERROR    -8   /* Invalid block size error          */
 #define DATA_ADDRESS_ERROR  -16  /* Invalid data address error        */
+#define SEEK_FAILED_ERROR   -32  /* Heads missed the cylinder on      */
+                                 /* every seek retry                  */
+#define CHECKSUM_FAILED_ERROR -64
+                                 /* Checksum failed on every transfer */
+                                 /* retry                             */
+#define DMA_FAILED_ERROR    -128 /* Disk refused the DMA setup        */
 #define READ_OP_CODE        1    /* Read request operation code       */
 #define WRITE_OP_CODE       2    /* Write request operation code      */
 #define DMA_SETUP_ERROR     -1   /* Impossible DMA error from disk    */
 #define CHECKSUM_ERROR      -2   /* Disk controller checksum failed   */
+#define HISTOGRAM_BUCKETS   32   /* Buckets of a histogram: 0, then   */
+                                 /* each power of two up to its double*/
+#define ARRIVAL_EVENT       0    /* Request came from the file system */
+#define DISPATCH_EVENT      1    /* Request picked to be served       */
+#define SEEK_EVENT          2    /* Heads reached its cylinder        */
+#define TRANSFER_EVENT      3    /* Its transfer finished             */
+#define COMPLETION_EVENT    4    /* Request queued for the file system*/
+#define TRACE_EVENTS        5    /* Times in a request's lifecycle    */
+#define TRACE_VERSION       1    /* Version of the trace file format  */
+#define CAPTURE_MESSAGE     0    /* Captured file system message      */
+#define CAPTURE_COMMAND     1    /* Captured disk command and result  */
+#define CAPTURE_VERSION     2    /* Version of the capture format     */
 
 /**********************************************************************/
 /*                         Program Structures                         */
@@ -95,21 +161,456 @@ struct message
 };
 typedef struct message MESSAGE;
 
+/* A division by a number fixed at startup, done as a multiply and a  */
+/* shift. The multiplier is the divisor's reciprocal rounded up, with */
+/* enough bits that the quotient of any nonnegative int is exact      */
+struct divisor
+{
+                 int divisor,         /* Number divided by            */
+                     shift;           /* Bits the product is shifted  */
+  unsigned long long multiplier;      /* Rounded up reciprocal        */
+};
+typedef struct divisor DIVISOR;
+
+/* Where a block starts on its cylinder                               */
+struct block_place
+{
+                 int track_number,    /* Track of its first sector    */
+                     sector_number;   /* Its first sector on that     */
+                                      /* track                        */
+};
+typedef struct block_place BLOCK_PLACE;
+
+/* The disk geometry, set at startup. Blocks fill each cylinder track */
+/* by track, so every cylinder lays its blocks out the same way: a    */
+/* block's cylinder takes one division, done as a multiply, and its   */
+/* track and sector come from a table of the places on a cylinder     */
+struct geometry
+{
+                char *p_name;         /* Name used to select geometry */
+                 int cylinders,       /* Number of cylinders          */
+                     tracks_per_cylinder,
+                                      /* Number of tracks per cylinder*/
+                     sectors_per_track,
+                                      /* Number of sectors per track  */
+                     blocks_per_cylinder,
+                                      /* Number of blocks per cylinder*/
+                     bytes_per_cylinder,
+                                      /* Number of bytes per cylinder */
+                     block_count;     /* Number of blocks on a drive  */
+             DIVISOR cylinder_divisor;/* Divides by the blocks per    */
+                                      /* cylinder                     */
+         BLOCK_PLACE *p_places;       /* Place of each block of a     */
+                                      /* cylinder                     */
+};
+typedef struct geometry GEOMETRY;
+
 /* A pending request                                                  */
 struct request
 {
                  int operation_code,  /* Disk operation to perform    */
                      request_number,  /* Unique request number        */
                      block_number,    /* Block number to read/write   */
+                     drive_block,     /* Block number on its drive    */
                      cylinder_number, /* Cylinder number for request  */
                      track_number,    /* Track number for request     */
                      sector_number,   /* Sector number for request    */
-                     block_size;      /* Block size in bytes          */
+                     block_size,      /* Block size in bytes          */
+                     error_code,      /* Completion code for the file */
+                                      /* system                       */
+                     priority,        /* Priority class of request    */
+                     sequential;      /* Read continues a stream      */
+           long long arrival_time;    /* Time the request arrived     */
+#ifdef DRIVER_METRICS
+           long long event_times[TRACE_EVENTS];
+                                      /* Time of each lifecycle event */
+                                      /* the request reached, or -1   */
+#endif
    unsigned long int *p_data_address; /* Points to a block in memory  */
-      struct request *p_next_request; /* Points to the next request   */
-};
+        struct drive *p_drive;        /* Points to the drive holding  */
+                                      /* the block                    */
+      struct request *p_next_request, /* Points to the next request   */
+                     *p_previous_request;
+                                      /* Points to previous request   */
+      struct request *p_next_arrival, /* Points to next newer request */
+                                      /* of the same priority         */
+                     *p_previous_arrival,
+                                      /* Points to next older request */
+                                      /* of the same priority         */
+                     *p_next_duplicate;
+                                      /* Points to a read of the same */
+                                      /* block waiting on this read   */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
 typedef struct request REQUEST;
 
+/* A fixed pool of requests, allocated once at startup. Free requests */
+/* are kept on a stack through their next request pointers, so the    */
+/* most recently freed (and cache warm) request is reused first.      */
+struct request_pool
+{
+                 int capacity,        /* Number of requests in pool   */
+                     in_use,          /* Requests currently allocated */
+                     high_water_mark, /* Most requests ever in use    */
+                     exhausted_count; /* Allocations the pool missed  */
+             REQUEST *p_requests,     /* Points to the pool's storage */
+                     *p_free_requests;/* Points to the free stack     */
+};
+typedef struct request_pool REQUEST_POOL;
+
+/* A disk scheduling policy                                           */
+struct scheduler
+{
+                char *p_name;         /* Name used to select policy   */
+             REQUEST *(*p_get_next_request)(struct drive *p_drive);
+                                      /* Picks the next request       */
+                 int sweep_to_edge,   /* Seek to the last cylinder    */
+                                      /* and back to cylinder 0 when  */
+                                      /* the sweep wraps around       */
+                     rotational;      /* Order requests on the heads' */
+                                      /* cylinder by rotational wait  */
+};
+typedef struct scheduler SCHEDULER;
+
+/* The retry policy for seeks that miss and transfers that fail their */
+/* checksum. Each retry waits a backoff first, doubling from the      */
+/* first retry's up to the longest, and once the retries run out the  */
+/* requests being served are failed back to the file system           */
+struct retry_policy
+{
+                 int seek_retries,    /* Recalibrations allowed per   */
+                                      /* seek                         */
+                     transfer_retries;/* Repeats allowed per transfer */
+           long long backoff,         /* Wait before the first retry  */
+                     max_backoff;     /* Longest wait before a retry  */
+};
+typedef struct retry_policy RETRY_POLICY;
+
+/* Driver activity counters                                           */
+struct statistics
+{
+                long coalesced_count, /* Requests that shared another */
+                                      /* request's transfer           */
+                     rotational_count,/* Requests moved ahead for a   */
+                                      /* shorter rotational wait      */
+                     absorbed_count,  /* Writes overwritten in queue  */
+                     forwarded_count, /* Reads served from a queued   */
+                                      /* write                        */
+                     duplicate_count, /* Reads sharing a queued read  */
+                     delivery_count,  /* Messages that carried        */
+                                      /* completions                  */
+                     rejected_count,  /* Invalid requests completed   */
+                                      /* at intake                    */
+                     poll_count,      /* Idle messages sent to pick   */
+                                      /* up requests while the drives */
+                                      /* were busy                    */
+                     queued_count,    /* Requests served from a queue */
+                     seek_failure_count,
+                                      /* Seeks that ran out of retries*/
+                     checksum_failure_count,
+                                      /* Transfers that ran out of    */
+                                      /* retries                      */
+                     dma_failure_count,
+                                      /* Transfers whose DMA setup    */
+                                      /* the disk refused             */
+                     failed_count;    /* Requests failed back to the  */
+                                      /* file system                  */
+           long long queue_wait,      /* Total time requests waited   */
+                                      /* in a queue to be served      */
+                     longest_queue_wait;
+                                      /* Longest such wait            */
+};
+typedef struct statistics STATISTICS;
+
+/* The pending requests, indexed by block number. Only valid          */
+/* requests are queued, so every slot is a real block. Each block     */
+/* slot holds a circular list of its requests in arrival order, and   */
+/* the occupancy maps find the next busy slot without walking the     */
+/* queue. The first map has a bit for each slot, and each map above   */
+/* it a bit for each word of the one below, up to a single word, so   */
+/* finding a busy slot takes a step per map however big the disk is.  */
+/* Cylinders are contiguous runs of slots, so slot order is also      */
+/* cylinder order.                                                    */
+struct request_queue
+{
+                 int request_count,   /* Number of pending requests   */
+                     map_levels;      /* Number of occupancy maps     */
+  unsigned long long *p_maps[MAX_MAP_LEVELS];
+                                      /* Bit set for each busy slot,  */
+                                      /* then for each busy word of   */
+                                      /* the map below                */
+      struct request **p_slot,        /* Oldest request of each block */
+                     *p_oldest[PRIORITY_CLASSES],
+                                      /* Oldest request of each class */
+                     *p_newest[PRIORITY_CLASSES];
+                                      /* Newest request of each class */
+};
+typedef struct request_queue REQUEST_QUEUE;
+
+/* Requests completed and waiting to be sent to the file system, in   */
+/* completion order through their next request pointers. Up to a      */
+/* batch of them are sent in one message, and none is held longer     */
+/* than the hold time                                                 */
+struct completion_queue
+{
+                 int request_count,   /* Number of completed requests */
+                     batch_size,      /* Most completions per message */
+                     due;             /* A drive found the batch      */
+                                      /* ready to send                */
+           long long hold_time,       /* Longest a completion waits   */
+                     first_time;      /* Time the oldest completed    */
+             REQUEST *p_first,        /* Oldest completed request     */
+                     *p_last;         /* Newest completed request     */
+};
+typedef struct completion_queue COMPLETION_QUEUE;
+
+/* A block cache entry                                                */
+struct cache_entry
+{
+                 int block_number,    /* Block cached, 0 if free      */
+                     referenced,      /* Used since the CLOCK hand    */
+                                      /* last passed                  */
+                     next_entry,      /* Next less recently used      */
+                     previous_entry;  /* Next more recently used      */
+};
+typedef struct cache_entry CACHE_ENTRY;
+
+/* A cache of recently read and written blocks. The entries are kept  */
+/* in most to least recently used order for LRU eviction, while the   */
+/* CLOCK hand sweeps them in index order                              */
+struct block_cache
+{
+                 int capacity,        /* Number of cached blocks      */
+                     eviction_policy, /* LRU or CLOCK eviction        */
+                     used_count,      /* Entries holding a block      */
+                     clock_hand,      /* Next entry CLOCK looks at    */
+                     most_recent,     /* Most recently used entry     */
+                     least_recent,    /* Least recently used entry    */
+                     *p_entry_of_block;
+                                      /* Entry holding each block     */
+                long hit_count,       /* Reads served from the cache  */
+                     miss_count,      /* Reads that went to the disk  */
+                     eviction_count;  /* Blocks evicted for others    */
+         CACHE_ENTRY *p_entries;      /* Points to the cache entries  */
+                char *p_data;         /* Points to the cached blocks  */
+};
+typedef struct block_cache BLOCK_CACHE;
+
+/* The motor power management policy. The fixed policy stops the      */
+/* motor once the disk has been idle for a set time. The adaptive     */
+/* policy remembers how long recent idle periods lasted and picks the */
+/* timeout that would have cost them the least, counting each         */
+/* microsecond spun idle against each microsecond of spin-up latency  */
+struct motor_policy
+{
+                 int adaptive,        /* Timeout adapts to the load   */
+                     history_count,   /* Idle periods remembered      */
+                     history_next;    /* Next history entry to fill   */
+           long long timeout,         /* Idle time before stopping    */
+                     max_timeout,     /* Longest adaptive timeout     */
+                     idle_start,      /* Time the disk went idle, or  */
+                                      /* NOT_IDLE                     */
+                     idle_history[IDLE_HISTORY],
+                                      /* Recent idle period lengths   */
+                     spin_up_time;    /* Total spin-up latency        */
+                long spin_up_count,   /* Motor spin-ups               */
+                     avoided_count;   /* Idle periods that ended with */
+                                      /* the motor still spinning     */
+};
+typedef struct motor_policy MOTOR_POLICY;
+
+/* A request priority class. Requests of each class wait on their own */
+/* arrival list, and once the oldest of them has waited as long as    */
+/* the class's deadline it is served ahead of the scheduling policy   */
+struct priority_class
+{
+                char *p_name,         /* Name used in the statistics  */
+                     *p_setting;      /* Setting for the deadline     */
+           long long deadline,        /* Longest a request should     */
+                                      /* wait, or 0 for no deadline   */
+                     longest_wait;    /* Longest time to completion   */
+                long request_count,   /* Requests completed           */
+                     expired_count,   /* Requests served because      */
+                                      /* their deadline was reached   */
+                     miss_count;      /* Requests completed after     */
+                                      /* their deadline               */
+};
+typedef struct priority_class PRIORITY_CLASS;
+
+/* A sequential read stream the driver is following                   */
+struct read_stream
+{
+                 int next_block,      /* Block the stream reads next  */
+                     length;          /* Blocks read in order         */
+                long last_use;        /* Read count at its last read  */
+};
+typedef struct read_stream READ_STREAM;
+
+/* The blocks a multiple block transfer left in memory, including     */
+/* any read ahead for a sequential stream. Transfers go straight in   */
+/* and out of the buffer, and reads of its blocks are served from     */
+/* memory until the buffer is reused                                  */
+struct track_buffer
+{
+   unsigned long int *p_data;         /* Points to the blocks held    */
+                 int first_block,     /* First block held             */
+                     block_count,     /* Blocks held, 0 if empty      */
+                     *p_block_state;  /* State of each block held     */
+                long last_use;        /* Read count at its last use   */
+};
+typedef struct track_buffer TRACK_BUFFER;
+
+/* Sequential stream detection, which reads ahead into each drive's   */
+/* track buffers. The read-ahead window grows when read ahead blocks  */
+/* are used and shrinks when they are thrown away                     */
+struct read_ahead
+{
+                 int window,          /* Blocks to read ahead         */
+                     max_window;      /* Largest read-ahead window    */
+                long read_count,      /* Reads checked for streams    */
+                     hit_count,       /* Reads served from a buffer   */
+                     prefetch_count,  /* Blocks read ahead            */
+                     useful_count,    /* Read ahead blocks later read */
+                     wasted_count;    /* Read ahead blocks thrown out */
+         READ_STREAM streams[READ_STREAMS];
+                                      /* Streams being followed       */
+};
+typedef struct read_ahead READ_AHEAD;
+
+/* A disk drive, with its own request queue, heads, motor and track   */
+/* buffers. With more than one drive, each drive is serviced by its   */
+/* own worker thread. The main thread hands a worker requests through */
+/* the drive's inbox, and the worker moves them into the queue, which */
+/* only it touches. The inbox is a stack guarded by the driver lock,  */
+/* like the rest of the shared state, and the worker takes it all at  */
+/* once between transfers                                             */
+struct drive
+{
+                 int unit,            /* Unit number of the drive     */
+                     current_cylinder,/* Cylinder the heads are on    */
+                     disk_on,         /* Status of the disk motor     */
+                     look_direction,  /* LOOK sweep, 1 up or -1 down  */
+                     rotational_sector,
+                                      /* Estimated sector under the   */
+                                      /* heads, or -1 if unknown      */
+                     batch_remaining; /* Requests left in the batch   */
+                                      /* after a deadline request     */
+                long seek_distance,   /* Total cylinders seeked       */
+                     transfer_count,  /* Disk reads and writes issued */
+                     recalibrate_count,
+                                      /* Recalibrations after a seek  */
+                                      /* missed its cylinder          */
+                     checksum_retry_count,
+                                      /* Transfers repeated after a   */
+                                      /* checksum error               */
+                     idle_intake;     /* Exchange with the file       */
+                                      /* system the idle worker last  */
+                                      /* saw the time after           */
+       REQUEST_QUEUE *p_queue;        /* Points to the request queue  */
+             REQUEST *p_inbox,        /* Newest request handed over   */
+                                      /* and not yet queued           */
+                     **p_run;         /* Requests in the transfer     */
+                                      /* being made                   */
+        MOTOR_POLICY motor_policy;    /* Motor power management       */
+        TRACK_BUFFER buffers[TRACK_BUFFERS];
+                                      /* Recently transferred blocks  */
+           pthread_t thread;          /* Worker servicing the drive   */
+      pthread_cond_t work_ready;      /* Signaled when work arrives   */
+                                      /* or time passes               */
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+typedef struct drive DRIVE;
+
+/* The header at the start of a capture file                          */
+struct capture_header
+{
+                char magic[8];        /* "DRVCAPTR"                   */
+                 int version,         /* Capture file format version  */
+                     record_size;     /* Bytes in each record         */
+};
+typedef struct capture_header CAPTURE_HEADER;
+
+/* A capture file record: a message the file system sent, as the      */
+/* driver copied it in, or a disk command and its result              */
+struct capture_record
+{
+           long long time;            /* Time of the event in us      */
+               short kind,            /* Message or disk command      */
+                     unit;            /* Drive commanded, or -1 for a */
+                                      /* message                      */
+                 int code,            /* Operation code, or command   */
+                     args[3],         /* Request number, block number */
+                                      /* and block size, or the       */
+                                      /* command's arguments          */
+                     result,          /* Command's result, or TRUE if */
+                                      /* a message had no data        */
+                                      /* address                      */
+                     exchange;        /* Exchange with the file       */
+                                      /* system a message came in, or */
+                                      /* -1 for a command             */
+};
+typedef struct capture_record CAPTURE_RECORD;
+
+#ifdef DRIVER_METRICS
+/* A histogram of values. Bucket 0 counts the values of 0 or less,    */
+/* and each bucket after it the values from a power of two up to just */
+/* under the next one                                                 */
+struct histogram
+{
+                long count,           /* Values recorded              */
+                     buckets[HISTOGRAM_BUCKETS];
+                                      /* Values in each bucket        */
+           long long total,           /* Sum of the values            */
+                     maximum;         /* Largest value                */
+};
+typedef struct histogram HISTOGRAM;
+
+/* The driver metrics, sent as a snapshot to the metrics file every   */
+/* interval, and the binary trace of completed requests               */
+struct metrics
+{
+           HISTOGRAM latency,         /* Arrival to completion, in us */
+                     service,         /* Dispatch to completion, in   */
+                                      /* us, of requests served by a  */
+                                      /* transfer                     */
+                     seek,            /* Cylinders seeked per         */
+                                      /* dispatch                     */
+                     queue_depth;     /* Drive queue depth at each    */
+                                      /* dispatch                     */
+                 int json;            /* Snapshots are JSON, not text */
+           long long interval,        /* Time between snapshots       */
+                     next_snapshot,   /* Time the next one is due     */
+                     last_time;       /* Time of the last completion, */
+                                      /* which dates the snapshots    */
+                FILE *p_snapshot_file,/* Snapshots go here, or NULL   */
+                     *p_trace_file;   /* Trace records go here, or    */
+                                      /* NULL                         */
+};
+typedef struct metrics METRICS;
+
+/* The header at the start of a trace file                            */
+struct trace_header
+{
+                char magic[8];        /* "DRVTRACE"                   */
+                 int version,         /* Trace file format version    */
+                     record_size;     /* Bytes in each trace record   */
+};
+typedef struct trace_header TRACE_HEADER;
+
+/* A trace file record, written as each request completes             */
+struct trace_record
+{
+                 int request_number,  /* Request's number             */
+                     block_number,    /* Block read or written        */
+                     operation_code,  /* Read or write                */
+                     error_code,      /* Completion code              */
+                     unit,            /* Drive unit, or -1 if none    */
+                     cylinder_number; /* Cylinder on that drive       */
+           long long event_times[TRACE_EVENTS];
+                                      /* Time of each lifecycle event */
+                                      /* reached, or -1               */
+};
+typedef struct trace_record TRACE_RECORD;
+#endif
+
 /**********************************************************************/
 /*                        Function Prototypes                         */
 /**********************************************************************/
@@ -118,382 +619,3161 @@ int disk_drive(int code, int arg1, int arg2, int arg3,
    /* Communicates with the disk                                      */
 void send_message(MESSAGE *p_fs_message);
    /* Communicates with the file system                               */
-REQUEST *create_request_list();
-   /* Creates an empty request list with a valid header and trailer   */
+int disk_drive_unit(int unit, int code, int arg1, int arg2, int arg3,
+                    unsigned long int *p_arg4) __attribute__((weak));
+   /* Communicates with one of several disks, if the environment      */
+   /* provides it                                                     */
+int drive_command(DRIVE *p_drive, int code, int arg1, int arg2,
+                  int arg3, unsigned long int *p_arg4);
+   /* Sends a command to a drive                                      */
+void load_geometry(char *p_setting);
+   /* Sets up the disk geometry from its setting                      */
+void create_divisor(DIVISOR *p_divisor, int divisor);
+   /* Sets up a division by a number fixed at startup                 */
+int divide(DIVISOR *p_divisor, int dividend);
+   /* Divides a nonnegative number without a divide instruction       */
+void create_drives(int count, int stripe);
+   /* Sets up the drives and the mapping of blocks onto them          */
+DRIVE *map_block(int block_number, int *p_drive_block);
+   /* Finds the drive holding a block and the block's number on it    */
+int unmap_block(DRIVE *p_drive, int drive_block);
+   /* Gets the block number of a block on a drive                     */
+void *run_drive(void *p_argument);
+   /* Services a drive on its own worker thread                       */
+int service_drive(DRIVE *p_drive);
+   /* Serves the next request in a drive's queue                      */
+void idle_drive(DRIVE *p_drive);
+   /* Stops an idle drive's motor once the spin-down timeout passes   */
+void end_drive_wait(DRIVE *p_drive, long long wait_start);
+   /* Forgets the heads' rotational position if the wait took time    */
+void wake_drives();
+   /* Lets the waiting workers see new requests and the time that has */
+   /* passed                                                          */
+void wait_for_idle_drives();
+   /* Waits for the idle drives' workers to see the time that passed  */
+REQUEST_QUEUE *create_request_queue();
+   /* Creates an empty pending request queue                          */
 int count_pending_requests();
-   /* Counts the pending requests in the requests list                */
+   /* Counts the requests not yet completed                           */
 void copy_messages();
    /* Copies file system messages into to the pending requests list   */
+void poll_file_system();
+   /* Sends an idle message and copies in the new messages            */
+void dispatch_request(REQUEST *p_request);
+   /* Hands a request to its drive                                    */
+void drain_inbox(DRIVE *p_drive);
+   /* Moves the requests handed to a drive into its queue             */
 void insert_request(REQUEST *p_request);
-   /* Inserts request into the pending request list sorted ascending  */
-   /* by block number                                                 */
+   /* Inserts request into the pending request queue slot for its     */
+   /* block number                                                    */
+void mark_slot_busy(REQUEST_QUEUE *p_queue, int slot);
+   /* Sets a slot's bit in the occupancy maps                         */
+void mark_slot_free(REQUEST_QUEUE *p_queue, int slot);
+   /* Clears a slot's bit in the occupancy maps                       */
+int find_busy_slot(REQUEST_QUEUE *p_queue, int first_slot);
+   /* Finds the first busy pending queue slot at or after a slot      */
+int find_busy_slot_below(REQUEST_QUEUE *p_queue, int last_slot);
+   /* Finds the last busy pending queue slot at or before a slot      */
+int cylinder_slot(int cylinder);
+   /* Gets the first pending queue slot of a cylinder                 */
 REQUEST *create_request(MESSAGE fs_request);
    /* Creates a new request from a file system request                */
+void create_request_pool(int capacity);
+   /* Allocates the fixed pool of requests                            */
+REQUEST *allocate_request();
+   /* Takes a request from the request pool                           */
+void free_request(REQUEST *p_request);
+   /* Returns a request to the request pool                           */
+int get_config_value(char *p_name, int default_value);
+   /* Gets an integer setting from the environment                    */
+void print_statistics();
+   /* Prints the driver statistics                                    */
 void convert_block(int block_number, int *p_cylinder, int *p_track,
                    int *p_sector);
    /* Converts file system block number to cylinder, track, and       */
    /* sector numbers                                                  */
-REQUEST *get_next_request(int request_cylinder);
+SCHEDULER *select_scheduler(char *p_name);
+   /* Looks up a disk scheduling policy by name                       */
+REQUEST *get_clook_request(DRIVE *p_drive);
    /* Gets the next request using the modified elevator algorithm     */
-void remove_request(int request_number);
-   /* Removes a request from the pending requests list                */
+REQUEST *get_look_request(DRIVE *p_drive);
+   /* Gets the next request using the elevator algorithm              */
+REQUEST *get_sstf_request(DRIVE *p_drive);
+   /* Gets the request on the cylinder nearest the heads              */
+REQUEST *get_fcfs_request(DRIVE *p_drive);
+   /* Gets the oldest request                                         */
+REQUEST *get_expired_request(DRIVE *p_drive);
+   /* Gets the oldest request of the most urgent class whose deadline */
+   /* has been reached                                                */
+REQUEST *get_cylinder_request(REQUEST_QUEUE *p_queue, int cylinder);
+   /* Gets the lowest block request on a request's cylinder           */
+REQUEST *get_rotational_request(DRIVE *p_drive);
+   /* Gets the request on the heads' cylinder that reaches the heads  */
+   /* first                                                           */
+int seek_cylinder(DRIVE *p_drive, int cylinder);
+   /* Seeks the heads to a cylinder, recalibrating after each miss    */
+   /* until the retries run out                                       */
+int validate_request(REQUEST *p_request);
+   /* Validates a request, returning the sum of its error codes       */
+int find_request_run(REQUEST *p_run[], int read_ahead);
+   /* Gathers requests for the blocks following a request, and blocks */
+   /* to read ahead                                                   */
+int transfer_requests(REQUEST *p_run[], int run_length,
+                      TRACK_BUFFER *p_buffer);
+   /* Reads or writes a run of adjacent blocks in one transfer        */
+void complete_request(REQUEST *p_request, int error_code);
+   /* Queues a completed request to be sent to the file system        */
+void complete_duplicates(REQUEST *p_request);
+   /* Completes the reads that were waiting on a read                 */
+void deliver_completions();
+   /* Sends the completed requests to the file system                 */
+int completions_due(DRIVE *p_drive);
+   /* Determines if the completed requests should be sent now         */
+void create_block_cache(int capacity, char *p_policy_name);
+   /* Allocates the block cache                                       */
+int find_cached_block(int block_number);
+   /* Looks a block up in the block cache                             */
+void cache_block(int block_number, unsigned long int *p_data);
+   /* Stores a copy of a block in the block cache                     */
+void uncache_block(int block_number);
+   /* Drops a block from the block cache                              */
+void use_cache_entry(int entry);
+   /* Marks a block cache entry as just used                          */
+int evict_cache_entry();
+   /* Frees a block cache entry for a new block                       */
+int block_write_pending(DRIVE *p_drive, int drive_block);
+   /* Determines if a write to a block is waiting in the queue        */
+int detect_stream(int block_number);
+   /* Determines if a read continues a sequential stream              */
+int read_buffered_block(REQUEST *p_request);
+   /* Serves a read from a track buffer if one holds the block        */
+void drop_buffered_blocks(DRIVE *p_drive, int drive_block,
+                          int block_size);
+   /* Drops the blocks a write changes from the track buffers         */
+TRACK_BUFFER *take_track_buffer(DRIVE *p_drive);
+   /* Empties the least recently used track buffer for a transfer     */
+void fill_track_buffer(TRACK_BUFFER *p_buffer, REQUEST *p_run[],
+                       int run_length);
+   /* Records the blocks a transfer left in a track buffer            */
+long long current_time();
+   /* Gets the time in microseconds                                   */
+void wait_microseconds(long long microseconds);
+   /* Waits for a number of microseconds                              */
+void back_off(int retry);
+   /* Waits out the backoff before a seek or transfer retry           */
+void create_motor_policy(char *p_policy_name);
+   /* Sets up the motor power management policy                       */
+void end_idle_period(DRIVE *p_drive);
+   /* Records an idle period and adapts the spin-down timeout         */
+void remove_request(REQUEST *p_request);
+   /* Removes a request from the pending request queue                */
 int power_of_two(int input_value);
    /* Determines if a number is a power of two or not                 */
+void create_capture(char *p_name);
+   /* Opens the capture file, if one was asked for                    */
+void capture_event(int kind, int unit, int code, int arg1, int arg2,
+                   int arg3, int result);
+   /* Writes a message or disk command to the capture file            */
+#ifdef DRIVER_METRICS
+void create_metrics();
+   /* Sets up the metrics snapshots and the trace file                */
+void record_value(HISTOGRAM *p_histogram, long long value);
+   /* Adds a value to a histogram                                     */
+void record_completion(REQUEST *p_request);
+   /* Records a completed request's latencies and trace record        */
+void take_metrics_snapshot();
+   /* Writes a metrics snapshot once the interval is up               */
+void write_metrics(FILE *p_file, int json);
+   /* Writes a snapshot of the driver metrics                         */
+void write_histogram(FILE *p_file, char *p_name,
+                     HISTOGRAM *p_histogram, int json);
+   /* Writes one histogram of a metrics snapshot                      */
+void finish_metrics();
+   /* Writes the last metrics snapshot                                */
+#endif
 
 /**********************************************************************/
 /*                         Global Variables                           */
 /**********************************************************************/
 MESSAGE fs_message[FS_MESSAGE_COUNT]; /* File system messages         */
-REQUEST *p_pending_requests;          /* Points to requests list      */
+GEOMETRY geometries[] =               /* Named disk geometries, the   */
+{                                     /* course's disk first          */
+   {.p_name              = "floppy", .cylinders         = 40,
+    .tracks_per_cylinder = 2,        .sectors_per_track = 9},
+   {.p_name              = "st225",  .cylinders         = 615,
+    .tracks_per_cylinder = 4,        .sectors_per_track = 17},
+   {.p_name              = "large",  .cylinders         = 4096,
+    .tracks_per_cylinder = 16,       .sectors_per_track = 63},
+   {.p_name              = NULL}
+};
+GEOMETRY geometry;                    /* Geometry of every drive      */
+DRIVE   *p_drives;                    /* Points to the drives         */
+int     drive_count,                  /* Number of drives             */
+        stripe_blocks,                /* Blocks per stripe, or 0 if   */
+                                      /* the drives are concatenated  */
+        max_block_number,             /* Last block across the drives */
+        pending_count = 0;            /* Requests not yet completed   */
+DIVISOR block_divisor,                /* Divides by blocks per drive  */
+        stripe_divisor,               /* Divides by blocks per stripe */
+        drive_divisor;                /* Divides by number of drives  */
+pthread_mutex_t driver_lock = PTHREAD_MUTEX_INITIALIZER;
+                                      /* Held by whichever thread is  */
+                                      /* working on the driver's      */
+                                      /* shared state                 */
+pthread_cond_t completions_ready = PTHREAD_COND_INITIALIZER;
+                                      /* Signaled when a drive has    */
+                                      /* completions ready to send,   */
+                                      /* or has finished a transfer   */
+int     pipelined,                    /* Workers serve the drives     */
+                                      /* while the main thread talks  */
+                                      /* to the file system           */
+        intake_due = FALSE;           /* A transfer has ended since   */
+                                      /* the file system was last     */
+                                      /* asked for new requests       */
+long    intake_count = 0;             /* Times the file system has    */
+                                      /* been asked for new requests  */
+REQUEST_POOL  request_pool;           /* Pool of free requests        */
+SCHEDULER schedulers[] =              /* Disk scheduling policies     */
+{
+   {"clook", get_clook_request, FALSE, TRUE},
+   {"cscan", get_clook_request, TRUE,  TRUE},
+   {"look",  get_look_request,  FALSE, TRUE},
+   {"sstf",  get_sstf_request,  FALSE, TRUE},
+   {"fcfs",  get_fcfs_request,  FALSE, FALSE},
+   {NULL,    NULL,              FALSE, FALSE}
+};
+SCHEDULER *p_scheduler;               /* Points to the active policy  */
+STATISTICS statistics;                /* Driver activity counters     */
+COMPLETION_QUEUE completed_requests;  /* Requests to send to the file */
+                                      /* system                       */
+BLOCK_CACHE block_cache;              /* Recently used blocks         */
+PRIORITY_CLASS priority_classes[PRIORITY_CLASSES] =
+{                                     /* Request priorities, most     */
+                                      /* urgent first                 */
+   {"sync reads",        "DRIVER_READ_DEADLINE_US",     2000000,
+    0, 0, 0, 0},
+   {"metadata writes",   "DRIVER_METADATA_DEADLINE_US", 3000000,
+    0, 0, 0, 0},
+   {"background writes", "DRIVER_WRITE_DEADLINE_US",    5000000,
+    0, 0, 0, 0}
+};
+int       metadata_blocks,            /* Writes to blocks up to this  */
+                                      /* one are metadata writes      */
+          deadline_batch;             /* Requests the scheduling      */
+                                      /* policy serves after a        */
+                                      /* deadline before deadlines    */
+                                      /* are checked again            */
+int       coalesce;                   /* Gather adjacent block        */
+                                      /* requests                     */
+int       rotational_skew;            /* Sectors that pass under the  */
+                                      /* heads while a transfer is    */
+                                      /* being set up                 */
+READ_AHEAD read_ahead;                /* Sequential read streams      */
+FILE      *p_capture_file = NULL;     /* Messages and disk commands   */
+                                      /* are captured here, if set    */
+RETRY_POLICY retry_policy;            /* Seek and transfer retries    */
+#ifdef DRIVER_METRICS
+METRICS   metrics;                    /* Latency, seek and queue      */
+                                      /* depth histograms             */
+#endif
 
 /**********************************************************************/
 /*                          Main Function                             */
 /**********************************************************************/
 int main()
 {
-   int     bytes_per_cylinder = BYTES_PER_SECTOR * SECTORS_PER_TRACK *
-                                TRACKS_PER_CYLINDER,
-                                  /* Number of bytes per cylinder     */
-           current_cylinder  = 0, /* Cylinder the heads are on        */
-           error_code,            /* Tracks errors for every request  */
-           checksum,              /* Checksum returned from the disk  */
-           idle_counter      = 0, /* Counts the idle requests sent    */
-           disk_on           = FALSE;
-                                  /* Status of the disk motor         */
-   REQUEST *p_request;            /* Points to the current request    */
+   int       priority,            /* Index of a priority class        */
+             drive;               /* Index of a drive                 */
+   long long wait_start;          /* Time the single drive began      */
+                                  /* waiting on the file system       */
+
+   /* Start capturing the messages and disk commands if asked to, so  */
+   /* even the first motor start is in the capture                    */
+   create_capture(getenv("DRIVER_CAPTURE_FILE"));
+
+   /* Set up the disk geometry, then the drives and the request pool  */
+   /* they share                                                      */
+   load_geometry(getenv("DISK_GEOMETRY"));
+   create_drives(get_config_value("DRIVER_DRIVES", 1),
+                 get_config_value("DRIVER_STRIPE_BLOCKS",
+                                  geometry.blocks_per_cylinder));
+   create_request_pool(MAX_PENDING_REQUESTS);
+
+   /* Select the disk scheduling policy                               */
+   p_scheduler = select_scheduler(getenv("DRIVER_SCHEDULER"));
+   coalesce    = get_config_value("DRIVER_COALESCE", TRUE);
+   if (get_config_value("DRIVER_ROTATIONAL", TRUE) == FALSE)
+      p_scheduler->rotational = FALSE;
+   rotational_skew = get_config_value("DRIVER_ROTATION_SKEW", 1);
 
-   /* Create a new pending requests list                              */
-   p_pending_requests = create_request_list();
+   /* Set how often a missed seek or failed transfer is retried, and  */
+   /* how long the retries back off                                   */
+   retry_policy.seek_retries     =
+      get_config_value("DRIVER_SEEK_RETRIES", 4);
+   retry_policy.transfer_retries =
+      get_config_value("DRIVER_TRANSFER_RETRIES", 4);
+   retry_policy.backoff          =
+      get_config_value("DRIVER_RETRY_BACKOFF_US", 1000);
+   retry_policy.max_backoff      =
+      get_config_value("DRIVER_MAX_RETRY_BACKOFF_US", 16000);
+   if (retry_policy.seek_retries < 0)
+      retry_policy.seek_retries = 0;
+   if (retry_policy.transfer_retries < 0)
+      retry_policy.transfer_retries = 0;
+
+   /* Set the largest number of blocks read ahead for a sequential    */
+   /* stream                                                          */
+   read_ahead.max_window = get_config_value("DRIVER_READ_AHEAD",
+                                  geometry.blocks_per_cylinder - 1);
+   if (read_ahead.max_window < 0)
+      read_ahead.max_window = 0;
+   read_ahead.window     = read_ahead.max_window;
+
+   /* Create the block cache if one was asked for                     */
+   create_block_cache(get_config_value("DRIVER_CACHE_BLOCKS", 0),
+                      getenv("DRIVER_CACHE_POLICY"));
+
+   /* Set up the motor power management policy                        */
+   create_motor_policy(getenv("DRIVER_MOTOR_POLICY"));
+
+   /* Set the deadline of each request priority class                 */
+   metadata_blocks = get_config_value("DRIVER_METADATA_BLOCKS",
+                                      geometry.blocks_per_cylinder);
+   for (priority = 0; priority < PRIORITY_CLASSES; priority++)
+      priority_classes[priority].deadline =
+         get_config_value(priority_classes[priority].p_setting,
+                          priority_classes[priority].deadline);
+   deadline_batch = get_config_value("DRIVER_DEADLINE_BATCH", 16);
+
+   /* Set how many completions are sent together, and how long one    */
+   /* may wait for the rest of its batch                              */
+   completed_requests.batch_size =
+      get_config_value("DRIVER_COMPLETION_BATCH", 1);
+   if (completed_requests.batch_size < 1)
+      completed_requests.batch_size = 1;
+   if (completed_requests.batch_size > FS_MESSAGE_COUNT)
+      completed_requests.batch_size = FS_MESSAGE_COUNT;
+   completed_requests.hold_time =
+      get_config_value("DRIVER_COMPLETION_HOLD_US", 20000);
+
+   /* Report the driver statistics at exit if they were asked for     */
+   if (get_config_value("DRIVER_STATISTICS", FALSE) == TRUE)
+      atexit(print_statistics);
+#ifdef DRIVER_METRICS
+   create_metrics();
+#endif
+
+   /* With more than one drive, start a worker thread for each, so    */
+   /* the main thread takes in new requests and sends completions     */
+   /* while the drives seek and transfer. A single drive is serviced  */
+   /* right here, so the driver runs against a disk and file system   */
+   /* that know nothing of threads                                    */
+   pipelined = drive_count > 1;
+   pthread_mutex_lock(&driver_lock);
+   if (pipelined == TRUE)
+      for (drive = 0; drive < drive_count; drive++)
+         if (pthread_create(&p_drives[drive].thread, NULL, run_drive,
+                            &p_drives[drive]) != 0)
+         {
+            printf("\nError #%d in main().", DRIVE_ALLOC_ERR);
+            printf("\nCannot start a worker thread for drive %d.",
+                   drive);
+            printf("\nThe program is aborting.");
+            exit(DRIVE_ALLOC_ERR);
+         }
 
    /* Loop processing file system requests                            */
    while(TRUE)
    {
       /* Loop sending idle messages until file system sends messages  */
+      wait_start = current_time();
       while(count_pending_requests() == 0)
       {
-         /* Send an idle message to the file system                   */
-         fs_message[0].operation_code = 0;
-         fs_message[0].request_number = 0;
-         fs_message[0].block_number   = 0;
-         fs_message[0].block_size     = 0;
-         fs_message[0].p_data_address = NULL;
-         send_message(fs_message);
-
-         /* Copy new messages into the pending request list           */
-         copy_messages();
-
-         /* Process the idle request if no messages were sent         */
+         /* Send an idle message to the file system, and send back    */
+         /* any new requests that completed without the disk          */
+         poll_file_system();
+         deliver_completions();
+
+         /* If no messages were sent the drives are idle, so let them */
+         /* turn their motors off once they have been idle as long as */
+         /* the motor policy's spin-down timeout                      */
          if (count_pending_requests() == 0)
          {
-            /* Increment the idle counter                             */
-            idle_counter += 1;
-
-            /* Turn off the disk if there are two idle requests       */
-            if (idle_counter >= 1)
-            {
-               if (disk_on == TRUE)
-                  disk_on = disk_drive(STOP_MOTOR,0,0,0,0);
-               idle_counter = 0;
-            }
+            if (pipelined == FALSE)
+               idle_drive(p_drives);
+            else
+               wait_for_idle_drives();
          }
       }
 
-      /* Check if the disk is on, and turn it on if it isn't          */
-      if (disk_on == FALSE)
-      {
-         disk_on = disk_drive(START_MOTOR,0,0,0,0);
-         disk_drive(MOTOR_STATUS,0,0,0,0);
-         current_cylinder = disk_drive(SENSE_CYLINDER,0,0,0,0);
-      }
-      else
+      /* Serve the next request of a single drive, sending the        */
+      /* completed requests once their batch is ready. The disk goes  */
+      /* on turning while the drive waits on the file system          */
+      if (pipelined == FALSE)
       {
-         /* Retrieve the request closest to the heads                 */
-         p_request = get_next_request(current_cylinder);
-
-         /* Seek to the cylinder of the current request if the        */
-         /* heads are not on the requested cylinder                   */
-         if (current_cylinder != p_request->cylinder_number)
+         end_drive_wait(p_drives, wait_start);
+         drain_inbox(p_drives);
+         if (p_drives->p_queue->request_count > 0 &&
+             service_drive(p_drives) == TRUE)
          {
-            do
-            {
-               current_cylinder = disk_drive(SEEK_CYLINDER,
-                                             p_request->cylinder_number,
-                                             0,0,0);
-               if (current_cylinder != p_request->cylinder_number)
-                  current_cylinder = disk_drive(RECALIBRATE,0,0,0,0);
-            }
-            while(current_cylinder != p_request->cylinder_number);
+            wait_start = current_time();
+            deliver_completions();
+            end_drive_wait(p_drives, wait_start);
          }
+      }
 
-         /* Set total error codes to 0                                */
-         error_code = 0;
-
-         /* Validate the operation code of the current request        */
-         if (p_request->operation_code != READ_OP_CODE &&
-             p_request->operation_code != WRITE_OP_CODE)
-            error_code += OP_CODE_ERROR;
-
-         /* Validate the request number of the current request        */
-         if (p_request->request_number < MIN_REQUEST_NUMBER)
-            error_code += REQUEST_NUM_ERROR;
-
-         /* Validate the block number of the current request          */
-         if (p_request->block_number < MIN_BLOCK_NUMBER ||
-             p_request->block_number > MAX_BLOCK_NUMBER)
-            error_code += BLOCK_NUM_ERROR;
-
-         /* Validate the block size of the current request            */
-         if (p_request->block_size > bytes_per_cylinder ||
-             power_of_two(p_request->block_size) != TRUE)
-            error_code += BLOCK_SIZE_ERROR;
-
-         /* Validate the data address of the current request          */
-         if (*p_request->p_data_address < 0)
-            error_code += DATA_ADDRESS_ERROR;
-
-         /* Prepare to send a completed request to the file system    */
-         fs_message[0].operation_code = error_code;
-         fs_message[0].request_number = p_request->request_number;
-         fs_message[0].block_number   = p_request->block_number;
-         fs_message[0].block_size     = p_request->block_size;
-         fs_message[0].p_data_address = p_request->p_data_address;
-
-         /* If validation succeeded, read or write to the disk        */
-         if (error_code == 0)
+      /* Otherwise wait for a worker to complete a batch or finish a  */
+      /* transfer. Send the batch, or ask the file system for the     */
+      /* requests that arrived during the transfer, so the workers    */
+      /* pick their next requests from the freshest set               */
+      else
+      {
+         while (completed_requests.due == FALSE &&
+                intake_due == FALSE && count_pending_requests() > 0)
+            pthread_cond_wait(&completions_ready, &driver_lock);
+         intake_due = FALSE;
+         if (completed_requests.due == FALSE &&
+             count_pending_requests() > 0)
          {
-            /* Set the DMA chip registers                             */
-            if (disk_drive(DMA_SETUP, p_request->sector_number,
-                                      p_request->track_number,
-                                      p_request->block_size,
-                                      p_request->p_data_address)
-                == DMA_SETUP_ERROR)
-            {
-               printf("\nError #%d in create_request_list().",
-                      DMA_SETUP_ERROR);
-               printf("\nImpossible DMA setup occurred in the disk controller.");
-               printf("\nThe program is aborting.");
-               exit(DMA_SETUP_ERROR);
-            }
-
-            /* Read or write to the disk                              */
-            if (p_request->operation_code == READ_OP_CODE)
-                do
-                {
-                   checksum = disk_drive(READ_DISK, 0, 0, 0, 0);
-                }
-               while(checksum == CHECKSUM_ERROR);
-            else if (p_request->operation_code == WRITE_OP_CODE)
-               do
-               {
-                  checksum = disk_drive(WRITE_DISK, 0, 0, 0, 0);
-               }
-               while(checksum == CHECKSUM_ERROR);
+            poll_file_system();
+            statistics.poll_count += 1;
+            if (completed_requests.request_count >=
+                                          completed_requests.batch_size)
+               completed_requests.due = TRUE;
          }
-
-         /* Send the completed request to the file system             */
-         send_message  (fs_message);
-         copy_messages ();
-         remove_request(p_request->request_number);
+         if (completed_requests.due == TRUE)
+            deliver_completions();
+         wake_drives();
       }
    }
    return 0;
 }
 
 /**********************************************************************/
-/*   Creates an empty request list with a valid header and trailer    */
+/*  Sends a command to a drive. The course's disk_drive() only knows  */
+/*     one disk, so a second drive needs the environment to provide   */
+/*                          disk_drive_unit()                         */
+/**********************************************************************/
+int drive_command(DRIVE *p_drive, int code, int arg1, int arg2,
+                  int arg3, unsigned long int *p_arg4)
+{
+   int result; /* Result of the command                               */
+
+   if (disk_drive_unit != NULL)
+      result = disk_drive_unit(p_drive->unit, code, arg1, arg2, arg3,
+                               p_arg4);
+   else
+      result = disk_drive(code, arg1, arg2, arg3, p_arg4);
+   if (p_capture_file != NULL)
+      capture_event(CAPTURE_COMMAND, p_drive->unit, code, arg1, arg2,
+                    arg3, result);
+   return result;
+}
+
+/**********************************************************************/
+/*  Sets up the disk geometry from its setting, which names one of    */
+/*  the known geometries or gives the cylinders, tracks per cylinder  */
+/*  and sectors per track outright, as in 40x2x9. With no setting the */
+/*    geometry is the course's disk. Every block must lie on one      */
+/*                              cylinder                              */
 /**********************************************************************/
-REQUEST *create_request_list()
+void load_geometry(char *p_setting)
 {
-   REQUEST *p_new_list; /* Points to the newly created request list   */
+   GEOMETRY  *p_named = geometries;
+                         /* Points to a named geometry                */
+   long long sectors;    /* Sectors per cylinder                      */
+   int       block,      /* Index of a block on a cylinder            */
+             sector;     /* Index of its first sector on the cylinder */
 
-   /* Get a new request and make it the table header                  */
-   if ((p_new_list = (REQUEST *)malloc(sizeof(REQUEST))) == NULL)
+   /* Look up the geometry by name, or read its dimensions            */
+   if (p_setting == NULL || *p_setting == '\0')
+      p_setting = geometries[0].p_name;
+   while (p_named->p_name != NULL &&
+          strcmp(p_named->p_name, p_setting) != 0)
+      p_named += 1;
+   if (p_named->p_name != NULL)
+      geometry = *p_named;
+   else if (sscanf(p_setting, "%dx%dx%d", &geometry.cylinders,
+                   &geometry.tracks_per_cylinder,
+                   &geometry.sectors_per_track) == 3)
+      geometry.p_name = p_setting;
+   else
    {
-      printf("\nError #%d in create_request_list().", HEADER_ALLOC_ERR);
-      printf("\nCannot allocate enough memory for the list header.");
+      printf("\nError #%d in load_geometry().", GEOMETRY_ERR);
+      printf("\nUnknown disk geometry \"%s\".", p_setting);
       printf("\nThe program is aborting.");
-      exit(HEADER_ALLOC_ERR);
+      exit(GEOMETRY_ERR);
    }
-   p_new_list->block_number = LIST_HEADER;
 
-   /* Get a new request and attach to end of the list as the trailer  */
-   if ((p_new_list->p_next_request = (REQUEST *)malloc(sizeof(REQUEST)))
-                                                                == NULL)
+   /* Check that whole blocks fill each cylinder, and that the blocks */
+   /* of every drive together can be numbered                         */
+   sectors = (long long)geometry.tracks_per_cylinder *
+             geometry.sectors_per_track;
+   if (geometry.cylinders < 1 || geometry.tracks_per_cylinder < 1 ||
+       geometry.sectors_per_track < 1 ||
+       sectors % SECTORS_PER_BLOCK != 0 ||
+       sectors / SECTORS_PER_BLOCK * geometry.cylinders >
+                                                       MAX_DISK_BLOCKS)
    {
-      printf("\nError #%d in create_request_list().", TRAILER_ALLOC_ERR);
-      printf("\nCannot allocate enough memory for the list trailer");
+      printf("\nError #%d in load_geometry().", GEOMETRY_ERR);
+      printf("\nThe disk geometry \"%s\" is not possible.", p_setting);
       printf("\nThe program is aborting.");
-      exit(TRAILER_ALLOC_ERR);
+      exit(GEOMETRY_ERR);
    }
-   p_new_list->p_next_request->block_number   = LIST_TRAILER;
-   p_new_list->p_next_request->p_next_request = NULL;
+   geometry.blocks_per_cylinder = sectors / SECTORS_PER_BLOCK;
+   geometry.bytes_per_cylinder  = sectors * BYTES_PER_SECTOR;
+   geometry.block_count         = geometry.blocks_per_cylinder *
+                                  geometry.cylinders;
+   create_divisor(&geometry.cylinder_divisor,
+                  geometry.blocks_per_cylinder);
 
-   /* Return the pointer to the newly created request list            */
-   return p_new_list;
+   /* Work out the track and sector each block of a cylinder starts   */
+   /* on, once for every cylinder                                     */
+   if ((geometry.p_places = (BLOCK_PLACE *)malloc(
+           geometry.blocks_per_cylinder * sizeof(BLOCK_PLACE))) == NULL)
+   {
+      printf("\nError #%d in load_geometry().", GEOMETRY_ERR);
+      printf("\nCannot allocate enough memory for the geometry.");
+      printf("\nThe program is aborting.");
+      exit(GEOMETRY_ERR);
+   }
+   for (block = 0; block < geometry.blocks_per_cylinder; block++)
+   {
+      sector = block * SECTORS_PER_BLOCK;
+      geometry.p_places[block].track_number  =
+         sector / geometry.sectors_per_track;
+      geometry.p_places[block].sector_number =
+         sector % geometry.sectors_per_track;
+   }
+   return;
 }
 
 /**********************************************************************/
-/*           Counts the messages sent by the file system              */
+/*  Sets up a division by a number fixed at startup. With the divisor */
+/*   taking L bits, the multiplier is 2 to the 31+L divided by the    */
+/*  divisor, rounded up. Its rounding error is under one part in 2 to */
+/*  the 31, so the product shifted down 31+L bits is the exact        */
+/*          quotient of any dividend below 2 to the 31                */
 /**********************************************************************/
-int count_pending_requests()
+void create_divisor(DIVISOR *p_divisor, int divisor)
 {
-   int     total_messages = 0; /* Message count from the file system  */
-   REQUEST *p_request     = p_pending_requests;
-                              /* Points to a pending request          */
+   int bits = 0; /* Bits needed to hold the divisor less one          */
 
-   /* Traverse the pending requests list counting each request        */
-   while (p_request = p_request->p_next_request,
-          p_request->block_number != LIST_TRAILER)
-      total_messages += 1;
-   return total_messages;
+   while ((1LL << bits) < divisor)
+      bits += 1;
+   p_divisor->divisor    = divisor;
+   p_divisor->shift      = DIVIDEND_BITS + bits;
+   p_divisor->multiplier = ((1ULL << p_divisor->shift) + divisor - 1) /
+                           divisor;
+   return;
 }
 
 /**********************************************************************/
-/*   Copies file system messages into to the pending requests list    */
+/*     Divides a nonnegative number by a divisor fixed at startup     */
 /**********************************************************************/
-void copy_messages()
+int divide(DIVISOR *p_divisor, int dividend)
 {
-   int message_count = 0; /* Counts file system messages              */
+   return (int)(((unsigned long long)dividend * p_divisor->multiplier)
+                >> p_divisor->shift);
+}
 
-   /* Loop copying file system messages                               */
-   while(message_count < FS_MESSAGE_COUNT &&
-         fs_message[message_count].operation_code != 0)
+/**********************************************************************/
+/*   Sets up the drives and the mapping of blocks onto them. Blocks   */
+/*   are striped across the drives a stripe at a time, or with no     */
+/*   stripe the drives are concatenated one after the other. Only     */
+/*   whole rows of stripes are used, so every drive holds as many     */
+/*                      blocks as the others                          */
+/**********************************************************************/
+void create_drives(int count, int stripe)
+{
+   DRIVE        *p_drive;  /* Points to a drive                       */
+   TRACK_BUFFER *p_buffer; /* Points to a track buffer                */
+   int          failed;    /* A drive's buffers could not be had      */
+
+   /* Settle the number of drives and how blocks are spread on them   */
+   drive_count   = count < 1 ? 1 : count > MAX_DRIVES ? MAX_DRIVES :
+                                                                 count;
+   stripe_blocks = stripe < 0 || drive_count == 1 ? 0 :
+                   stripe > geometry.block_count ?
+                                        geometry.block_count : stripe;
+   if (stripe_blocks == 0)
+      max_block_number = drive_count * geometry.block_count;
+   else
+      max_block_number = drive_count * stripe_blocks *
+                         (geometry.block_count / stripe_blocks);
+   create_divisor(&block_divisor,  geometry.block_count);
+   create_divisor(&stripe_divisor, stripe_blocks > 0 ? stripe_blocks :
+                                                                    1);
+   create_divisor(&drive_divisor,  drive_count);
+   if (drive_count > 1 && disk_drive_unit == NULL)
    {
-      /* Insert the new request sorting ascending by cylinder         */
-      insert_request(create_request(fs_message[message_count]));
-      message_count += 1;
+      printf("\nError #%d in create_drives().", DRIVE_UNIT_ERR);
+      printf("\nThe disk interface cannot address %d drives.",
+             drive_count);
+      printf("\nThe program is aborting.");
+      exit(DRIVE_UNIT_ERR);
+   }
+
+   /* Get cache line aligned storage for the drives                   */
+   if (posix_memalign((void **)&p_drives, CACHE_LINE_SIZE,
+                      drive_count * sizeof(DRIVE)) != 0)
+   {
+      printf("\nError #%d in create_drives().", DRIVE_ALLOC_ERR);
+      printf("\nCannot allocate enough memory for the drives.");
+      printf("\nThe program is aborting.");
+      exit(DRIVE_ALLOC_ERR);
+   }
+
+   /* Start every drive with its heads on an unknown cylinder, its    */
+   /* motor off and its queue, inbox and track buffers empty          */
+   memset(p_drives, 0, drive_count * sizeof(DRIVE));
+   for (p_drive = p_drives; p_drive < p_drives + drive_count;
+        p_drive++)
+   {
+      p_drive->unit              = p_drive - p_drives;
+      p_drive->disk_on           = FALSE;
+      p_drive->look_direction    = 1;
+      p_drive->rotational_sector = -1;
+      p_drive->p_queue           = create_request_queue();
+      p_drive->p_inbox           = NULL;
+      pthread_cond_init(&p_drive->work_ready, NULL);
+
+      /* Make room for transfers and track buffers of up to a whole   */
+      /* cylinder                                                     */
+      failed = (p_drive->p_run = (REQUEST **)malloc(
+                   geometry.blocks_per_cylinder * sizeof(REQUEST *)))
+                                                               == NULL;
+      for (p_buffer = p_drive->buffers;
+           p_buffer < p_drive->buffers + TRACK_BUFFERS; p_buffer++)
+         if (posix_memalign((void **)&p_buffer->p_data, CACHE_LINE_SIZE,
+                            geometry.bytes_per_cylinder) != 0 ||
+             (p_buffer->p_block_state = (int *)calloc(
+                 geometry.blocks_per_cylinder, sizeof(int))) == NULL)
+            failed = TRUE;
+      if (failed == TRUE)
+      {
+         printf("\nError #%d in create_drives().", DRIVE_ALLOC_ERR);
+         printf("\nCannot allocate enough memory for track buffers.");
+         printf("\nThe program is aborting.");
+         exit(DRIVE_ALLOC_ERR);
+      }
    }
    return;
 }
 
 /**********************************************************************/
-/* Inserts request into the pending request list sorted ascending by  */
-/*                           block number                             */
+/*   Finds the drive holding a block, along with the block's number   */
+/*                            on that drive                           */
 /**********************************************************************/
-void insert_request(REQUEST *p_request)
+DRIVE *map_block(int block_number, int *p_drive_block)
 {
-   REQUEST *p_current  = p_pending_requests->p_next_request,
-                        /* Points to the current request              */
-           *p_previous = p_pending_requests;
-                        /* Points to the previous request             */
+   int index = block_number - MIN_BLOCK_NUMBER,
+             /* Index of the block across the drives                  */
+       drive,
+             /* Index of the block's drive                            */
+       stripe,
+             /* Index of the block's stripe                           */
+       row;
+             /* Index of the stripe's row across the drives           */
 
-   /* Traverse the pending request to find the insertion point        */
-   while(p_current->block_number  <= p_request->block_number &&
-         p_current->block_number  != LIST_TRAILER)
+   if (stripe_blocks == 0)
    {
-      p_previous = p_current;
-      p_current  = p_current->p_next_request;
+      drive          = divide(&block_divisor, index);
+      *p_drive_block = index - drive * geometry.block_count +
+                       MIN_BLOCK_NUMBER;
+      return &p_drives[drive];
    }
+   stripe         = divide(&stripe_divisor, index);
+   row            = divide(&drive_divisor, stripe);
+   *p_drive_block = row * stripe_blocks + index -
+                    stripe * stripe_blocks + MIN_BLOCK_NUMBER;
+   return &p_drives[stripe - row * drive_count];
+}
+
+/**********************************************************************/
+/*  Gets the block number of a block on a drive, undoing map_block()  */
+/**********************************************************************/
+int unmap_block(DRIVE *p_drive, int drive_block)
+{
+   int index = drive_block - MIN_BLOCK_NUMBER,
+             /* Index of the block on its drive                       */
+       drive = p_drive - p_drives,
+             /* Index of the block's drive                            */
+       row;
+             /* Index of the stripe's row across the drives           */
+
+   if (stripe_blocks == 0)
+      return drive * geometry.block_count + index + MIN_BLOCK_NUMBER;
+   row = divide(&stripe_divisor, index);
+   return (row * drive_count + drive) * stripe_blocks + index -
+          row * stripe_blocks + MIN_BLOCK_NUMBER;
+}
+
+/**********************************************************************/
+/*  Waits for the workers of the idle drives to see the time that has */
+/*    passed since the last exchange with the file system, so each    */
+/*       stops its motor as soon as the spin-down timeout is up       */
+/**********************************************************************/
+void wait_for_idle_drives()
+{
+   DRIVE *p_drive; /* Points to a drive                               */
 
-   /* Link the request into the pending requests list                 */
-   p_previous->p_next_request = p_request;
-   p_request->p_next_request  = p_current;
+   for (p_drive = p_drives; p_drive < p_drives + drive_count;
+        p_drive++)
+      while (p_drive->p_queue->request_count == 0 &&
+             p_drive->p_inbox == NULL &&
+             p_drive->idle_intake != intake_count)
+         pthread_cond_wait(&completions_ready, &driver_lock);
    return;
 }
 
 /**********************************************************************/
-/*          Creates a new request from a file system request          */
+/*   Services a drive on its own worker thread, moving the requests   */
+/*   handed to it into its queue and serving them, and letting the    */
+/*   main thread know when a batch of completions is ready to send    */
 /**********************************************************************/
-REQUEST *create_request(MESSAGE message)
+void *run_drive(void *p_argument)
 {
-   REQUEST *p_new_request; /* Points to a new request                 */
+   DRIVE     *p_drive = (DRIVE *)p_argument;
+                        /* Points to the drive the worker services    */
+   long      intake = -1;
+                        /* Times the file system had been asked for   */
+                        /* new requests when the last transfer ended  */
+   long long wait_start;/* Time the worker began waiting              */
 
-   /* Create a new process                                            */
-   if ((p_new_request = (REQUEST *)malloc(sizeof(REQUEST))) == NULL)
+   pthread_mutex_lock(&driver_lock);
+   while (TRUE)
    {
-      printf("\nError #%d in create_request().", REQUEST_ALLOC_ERR);
-      printf("\nCannot allocate enough memory for a new request.");
-      printf("\nThe program is aborting.");
-      exit(REQUEST_ALLOC_ERR);
+      drain_inbox(p_drive);
+
+      /* Let the main thread send the completions, or ask the file    */
+      /* system for the requests that arrived during the transfer,    */
+      /* while the drive goes straight on to its next request. What   */
+      /* the main thread takes in meanwhile waits in the inbox for    */
+      /* the pick after that                                          */
+      if (p_drive->p_queue->request_count > 0)
+      {
+         if (service_drive(p_drive) == TRUE ||
+             count_pending_requests() == 0)
+            completed_requests.due = TRUE;
+         else
+            intake_due = TRUE;
+         pthread_cond_signal(&completions_ready);
+         intake = intake_count;
+      }
+
+      /* A queue that ran dry during the transfer may only be waiting */
+      /* for the requests that arrived meanwhile, so wait for the     */
+      /* main thread to take them in before counting the drive idle   */
+      else if (intake == intake_count)
+      {
+         intake_due = TRUE;
+         pthread_cond_signal(&completions_ready);
+         wait_start = current_time();
+         while (intake_count == intake && p_drive->p_inbox == NULL)
+            pthread_cond_wait(&p_drive->work_ready, &driver_lock);
+         end_drive_wait(p_drive, wait_start);
+      }
+      else
+      {
+         /* An idle drive sends what it completed, and then waits for */
+         /* work, stopping its motor if time passes without any       */
+         wait_start = current_time();
+         if (completed_requests.p_first != NULL)
+         {
+            completed_requests.due = TRUE;
+            pthread_cond_signal(&completions_ready);
+         }
+         idle_drive(p_drive);
+         p_drive->idle_intake = intake_count;
+         pthread_cond_signal(&completions_ready);
+         if (p_drive->p_inbox == NULL)
+            pthread_cond_wait(&p_drive->work_ready, &driver_lock);
+         end_drive_wait(p_drive, wait_start);
+      }
    }
+   return NULL;
+}
 
-   /* Construct the new request from the file system message data     */
-   p_new_request->operation_code = message.operation_code;
-   p_new_request->request_number = message.request_number;
-   p_new_request->block_number   = message.block_number;
-   convert_block(p_new_request->block_number,
-                &p_new_request->cylinder_number,
-                &p_new_request->track_number,
-                &p_new_request->sector_number);
-   p_new_request->block_size     = message.block_size;
-   p_new_request->p_data_address = message.p_data_address;
+/**********************************************************************/
+/*   Serves the next request in a drive's queue, along with the run   */
+/*  of requests it heads, and determines if the completed requests    */
+/*  should be sent now. The driver lock is let go while the drive is  */
+/*                                busy                                */
+/**********************************************************************/
+int service_drive(DRIVE *p_drive)
+{
+   int     sweep = FALSE,         /* Sweep to the disk's edge first   */
+           run_length,            /* Requests in the current transfer */
+           run_index,             /* Index of a request in transfer   */
+           error_code = 0;        /* Failure of the seek or transfer, */
+                                  /* or 0                             */
+   long long now,                 /* Time the run is picked           */
+             wait;                /* Time a request waited in queue   */
+   TRACK_BUFFER *p_buffer;        /* Buffer a multiple block transfer */
+                                  /* goes through                     */
+   REQUEST *p_request,            /* Points to the current request    */
+           **p_run = p_drive->p_run;
+                                  /* Requests in the current transfer */
+   long long spin_up_start,       /* Time the motor was started       */
+             spin_up_time;        /* Time the motor took to start     */
+#ifdef DRIVER_METRICS
+   long      seek_start;          /* Drive's seek distance before the */
+                                  /* run's seek                       */
+   long long seek_done,           /* Time the heads reached the run's */
+                                  /* cylinder                         */
+             transfer_done;       /* Time the run's transfer finished */
+#endif
 
-   /* Return a pointer to the new request                             */
-   return p_new_request;
+   /* Record the idle period that just ended, if there was one        */
+   if (p_drive->motor_policy.idle_start != NOT_IDLE)
+      end_idle_period(p_drive);
+
+   /* Check if the disk is on, and turn it on if it isn't             */
+   if (p_drive->disk_on == FALSE)
+   {
+      pthread_mutex_unlock(&driver_lock);
+      spin_up_start    = current_time();
+      p_drive->disk_on = drive_command(p_drive, START_MOTOR,0,0,0,0);
+      drive_command(p_drive, MOTOR_STATUS,0,0,0,0);
+      p_drive->current_cylinder =
+         drive_command(p_drive, SENSE_CYLINDER,0,0,0,0);
+      spin_up_time     = current_time() - spin_up_start;
+      pthread_mutex_lock(&driver_lock);
+      p_drive->rotational_sector = -1;
+      p_drive->motor_policy.spin_up_count += 1;
+      p_drive->motor_policy.spin_up_time  += spin_up_time;
+      return FALSE;
+   }
+
+   /* Serve a request whose deadline has been reached first, unless   */
+   /* the scheduling policy is still working through the batch that   */
+   /* followed the last one. Otherwise retrieve the next request from */
+   /* the scheduling policy                                           */
+   p_request = NULL;
+   if (p_drive->batch_remaining > 0)
+      p_drive->batch_remaining -= 1;
+   else if ((p_request = get_expired_request(p_drive)) != NULL)
+      p_drive->batch_remaining = deadline_batch;
+   if (p_request == NULL)
+   {
+      p_request = p_scheduler->p_get_next_request(p_drive);
+
+      /* If the request is on the heads' cylinder and the sector      */
+      /* under the heads is known, take whichever request on the      */
+      /* cylinder will rotate under the heads first instead           */
+      if (p_scheduler->rotational == TRUE &&
+          p_drive->rotational_sector >= 0 &&
+          p_request->cylinder_number == p_drive->current_cylinder)
+         p_request = get_rotational_request(p_drive);
+
+      /* Sweep out to the last cylinder and back to the first one if  */
+      /* the policy scans the whole disk before wrapping around       */
+      sweep = p_scheduler->sweep_to_edge == TRUE &&
+              p_request->cylinder_number < p_drive->current_cylinder;
+   }
+
+   /* Gather the requests for the blocks following the current        */
+   /* request on the cylinder, along with the blocks to read ahead of */
+   /* a sequential stream, so they are all read or written in one     */
+   /* transfer                                                        */
+   p_run[0]   = p_request;
+   run_length = 1;
+   if (coalesce == TRUE)
+      run_length = find_request_run(p_run,
+                      p_request->sequential == TRUE ?
+                         read_ahead.window : 0);
+   p_buffer = run_length > 1 ? take_track_buffer(p_drive) : NULL;
+
+   /* Note how long the requests waited in the queue to be served     */
+   now = current_time();
+   for (run_index = 0; run_index < run_length; run_index++)
+      if (p_run[run_index] != NULL)
+      {
+         wait = now - p_run[run_index]->arrival_time;
+         statistics.queued_count += 1;
+         statistics.queue_wait   += wait;
+         if (wait > statistics.longest_queue_wait)
+            statistics.longest_queue_wait = wait;
+#ifdef DRIVER_METRICS
+         p_run[run_index]->event_times[DISPATCH_EVENT] = now;
+#endif
+      }
+#ifdef DRIVER_METRICS
+   record_value(&metrics.queue_depth, p_drive->p_queue->request_count);
+   seek_start = p_drive->seek_distance;
+#endif
+
+   /* Seek to the cylinder of the current request if the heads are    */
+   /* not on the requested cylinder, and transfer the run. Only this  */
+   /* drive's worker touches its queue and the track buffer it took,  */
+   /* so the other threads may go on meanwhile. A seek or transfer    */
+   /* that fails once its retries run out fails the run               */
+   pthread_mutex_unlock(&driver_lock);
+   if (sweep == TRUE)
+   {
+      seek_cylinder(p_drive, geometry.cylinders - 1);
+      seek_cylinder(p_drive, 0);
+   }
+   if (seek_cylinder(p_drive, p_request->cylinder_number) == FALSE)
+      error_code = SEEK_FAILED_ERROR;
+#ifdef DRIVER_METRICS
+   seek_done = current_time();
+#endif
+   if (error_code == 0)
+      error_code = transfer_requests(p_run, run_length, p_buffer);
+#ifdef DRIVER_METRICS
+   transfer_done = current_time();
+#endif
+   pthread_mutex_lock(&driver_lock);
+#ifdef DRIVER_METRICS
+   record_value(&metrics.seek, p_drive->seek_distance - seek_start);
+#endif
+   if (error_code == SEEK_FAILED_ERROR)
+      statistics.seek_failure_count     += 1;
+   else if (error_code == CHECKSUM_FAILED_ERROR)
+      statistics.checksum_failure_count += 1;
+   else if (error_code == DMA_FAILED_ERROR)
+      statistics.dma_failure_count      += 1;
+
+   /* Take the run off the queue, keeping a copy of each block it     */
+   /* transferred in the block cache unless a newer write to it is    */
+   /* waiting, and complete the requests                              */
+   for (run_index = 0; run_index < run_length; run_index++)
+      if ((p_request = p_run[run_index]) != NULL)
+      {
+#ifdef DRIVER_METRICS
+         p_request->event_times[SEEK_EVENT]     = seek_done;
+         p_request->event_times[TRANSFER_EVENT] = transfer_done;
+#endif
+         remove_request(p_request);
+         if (error_code == 0 && block_cache.capacity > 0 &&
+             p_request->block_size == BYTES_PER_BLOCK &&
+             block_write_pending(p_drive, p_request->drive_block) ==
+                                                                 FALSE)
+            cache_block(p_request->block_number,
+                        p_request->p_data_address);
+         if (error_code != 0)
+            statistics.failed_count += 1;
+         complete_request(p_request, error_code);
+         complete_duplicates(p_request);
+      }
+
+   /* Keep the blocks a multiple block read left in its track buffer, */
+   /* or drop the buffered blocks a write changed. A failed transfer  */
+   /* leaves its track buffer empty                                   */
+   if (p_buffer != NULL && error_code == 0)
+      fill_track_buffer(p_buffer, p_run, run_length);
+   else if (p_run[0]->operation_code == WRITE_OP_CODE)
+      drop_buffered_blocks(p_drive, p_run[0]->drive_block,
+                           p_run[0]->block_size);
+   return run_length > 1 || completions_due(p_drive) == TRUE;
 }
 
 /**********************************************************************/
-/* Converts file system block numbers to cylinder, track, and sector  */
-/*                              numbers                               */
+/*  Notes when a drive went idle, and turns its motor off once it has */
+/*  been idle as long as the motor policy's spin-down timeout         */
 /**********************************************************************/
-void convert_block(int block_number, int *p_cylinder, int *p_track,
-                   int *p_sector)
+void idle_drive(DRIVE *p_drive)
 {
-   /* Calculate the cylinder number                                   */
-   *p_cylinder  = (block_number - 1) /  SECTORS_PER_TRACK;
+   MOTOR_POLICY *p_policy = &p_drive->motor_policy;
+                            /* Points to the drive's motor policy     */
+
+   if (p_policy->idle_start == NOT_IDLE)
+      p_policy->idle_start = current_time();
+   if (p_drive->disk_on == TRUE &&
+       current_time() - p_policy->idle_start >= p_policy->timeout)
+   {
+      pthread_mutex_unlock(&driver_lock);
+      p_drive->disk_on = drive_command(p_drive, STOP_MOTOR,0,0,0,0);
+      pthread_mutex_lock(&driver_lock);
+   }
+   return;
+}
+
+/**********************************************************************/
+/*   Forgets where in its rotation a drive's disk is once the drive   */
+/*   has waited, as on the file system, for any time at all. The      */
+/*   estimate only holds right after a transfer, and a disk that kept */
+/*          turning through the wait is somewhere else now            */
+/**********************************************************************/
+void end_drive_wait(DRIVE *p_drive, long long wait_start)
+{
+   if (current_time() != wait_start)
+      p_drive->rotational_sector = -1;
+   return;
+}
 
-   /* Calculate the track number                                      */
-   *p_track     = (block_number - 1) % SECTORS_PER_TRACK;
-   *p_track     = *p_track >= SECTORS_PER_TRACK * 0.5f ? 1 : 0;
+/**********************************************************************/
+/*   Wakes the waiting workers, so each sees the requests that have   */
+/*   arrived and the time that has passed, and an idle drive stops    */
+/*                 its motor once it is due to                        */
+/**********************************************************************/
+void wake_drives()
+{
+   int drive; /* Index of a drive                                     */
 
-   /* Calculate the sector number                                     */
-   *p_sector    = (block_number - 1) % (SECTORS_PER_TRACK) * 2;
-   if (*p_sector > SECTORS_PER_TRACK)
-      *p_sector = *p_sector - SECTORS_PER_TRACK;
+   for (drive = 0; drive < drive_count; drive++)
+      pthread_cond_signal(&p_drives[drive].work_ready);
    return;
 }
 
 /**********************************************************************/
-/*    Gets the next request using the modified elevator algorithm     */
+/*               Creates an empty pending request queue               */
 /**********************************************************************/
-REQUEST *get_next_request(int request_cylinder)
+REQUEST_QUEUE *create_request_queue()
 {
-   REQUEST *p_request = p_pending_requests->p_next_request;
-                        /* Points to a request                        */
+   REQUEST_QUEUE *p_new_queue; /* Points to the new request queue     */
+   int           slot,         /* Index of a pending queue slot       */
+                 bits,         /* Bits in an occupancy map            */
+                 words,        /* Words in an occupancy map           */
+                 failed;       /* Memory for the queue ran out        */
 
-   /* Get the request closest to the requested cylinder               */
-   while(p_request->cylinder_number < request_cylinder &&
-         p_request->block_number    != LIST_TRAILER)
-      p_request = p_request->p_next_request;
+   /* Get a new request queue, with a slot for each block of a drive  */
+   if ((p_new_queue = (REQUEST_QUEUE *)malloc(sizeof(REQUEST_QUEUE)))
+                                                                == NULL)
+   {
+      printf("\nError #%d in create_request_queue().", QUEUE_ALLOC_ERR);
+      printf("\nCannot allocate enough memory for the request queue.");
+      printf("\nThe program is aborting.");
+      exit(QUEUE_ALLOC_ERR);
+   }
+   failed = (p_new_queue->p_slot = (REQUEST **)calloc(
+                geometry.block_count + MIN_BLOCK_NUMBER,
+                sizeof(REQUEST *))) == NULL;
 
-   /* Return the first request if end of the requests list is reached */
-   if (p_request->block_number == LIST_TRAILER)
-      p_request = p_pending_requests->p_next_request;
+   /* Stack up occupancy maps until one word covers the one below.    */
+   /* Each gets a spare word past its end, so a search may step just  */
+   /* off the end of a map and find it empty                          */
+   p_new_queue->map_levels = 0;
+   bits = geometry.block_count + MIN_BLOCK_NUMBER;
+   do
+   {
+      words = (bits + BITS_PER_WORD - 1) / BITS_PER_WORD;
+      if ((p_new_queue->p_maps[p_new_queue->map_levels] =
+              (unsigned long long *)calloc(words + 1,
+                 sizeof(unsigned long long))) == NULL)
+         failed = TRUE;
+      p_new_queue->map_levels += 1;
+      bits = words;
+   }
+   while (words > 1);
+   if (failed == TRUE)
+   {
+      printf("\nError #%d in create_request_queue().", QUEUE_ALLOC_ERR);
+      printf("\nCannot allocate enough memory for the queue slots.");
+      printf("\nThe program is aborting.");
+      exit(QUEUE_ALLOC_ERR);
+   }
 
-   /* Return a pointer to the found request                           */
-   return p_request;
+   /* Mark every arrival list of the new queue as empty               */
+   p_new_queue->request_count = 0;
+   for (slot = 0; slot < PRIORITY_CLASSES; slot++)
+   {
+      p_new_queue->p_oldest[slot] = NULL;
+      p_new_queue->p_newest[slot] = NULL;
+   }
+
+   /* Return the pointer to the newly created request queue           */
+   return p_new_queue;
+}
+
+/**********************************************************************/
+/*   Counts the requests sent by the file system not yet completed    */
+/**********************************************************************/
+int count_pending_requests()
+{
+   return pending_count;
 }
 
 /**********************************************************************/
-/*          Removes a request from the pending requests list          */
+/*   Copies file system messages into to the pending requests list    */
 /**********************************************************************/
-void remove_request(int request_number)
+void copy_messages()
 {
-   REQUEST *p_current  = p_pending_requests->p_next_request,
-                        /* Points to the pending requests list        */
-           *p_previous = p_pending_requests;
-                        /* Points to the previous request             */
+   int message_count = 0; /* Counts file system messages              */
 
-   /* Find the request to be removed from the pending requests list   */
-   while(p_current->request_number != request_number &&
-         p_current->block_number   != LIST_TRAILER)
+   REQUEST *p_request;    /* Points to the new request                */
+   int     entry,         /* Block cache entry of the request's block */
+           error_code,    /* Errors found in the new request          */
+           block,         /* A drive block a write changes            */
+           last_block;    /* Last drive block a write changes         */
+
+   /* Loop copying file system messages                               */
+   while(message_count < FS_MESSAGE_COUNT &&
+         fs_message[message_count].operation_code != 0)
    {
-      p_previous = p_current;
-      p_current  = p_current->p_next_request;
+      if (p_capture_file != NULL)
+         capture_event(CAPTURE_MESSAGE, -1,
+                       fs_message[message_count].operation_code,
+                       fs_message[message_count].request_number,
+                       fs_message[message_count].block_number,
+                       fs_message[message_count].block_size,
+                       fs_message[message_count].p_data_address ==
+                                                                 NULL);
+      p_request = create_request(fs_message[message_count]);
+
+      /* Complete invalid requests right away with their errors, so   */
+      /* they never reach the queue or move the heads                 */
+      if ((error_code = validate_request(p_request)) != 0)
+      {
+         complete_request(p_request, error_code);
+         statistics.rejected_count += 1;
+         p_request = NULL;
+      }
+
+      /* Drop the cached and buffered copies of every block being     */
+      /* written, whatever the size of the write, so no read is       */
+      /* served a stale block before the write reaches the disk. A    */
+      /* write covers the blocks that follow it on its own drive,     */
+      /* which a stripe may number far apart                          */
+      else if (p_request->operation_code == WRITE_OP_CODE)
+      {
+         if (block_cache.capacity > 0)
+         {
+            last_block = p_request->drive_block +
+                         (p_request->block_size - 1) / BYTES_PER_BLOCK;
+            if (last_block >= max_block_number / drive_count +
+                                                       MIN_BLOCK_NUMBER)
+               last_block = max_block_number / drive_count +
+                            MIN_BLOCK_NUMBER - 1;
+            for (block = p_request->drive_block; block <= last_block;
+                 block++)
+               uncache_block(unmap_block(p_request->p_drive, block));
+         }
+         drop_buffered_blocks(p_request->p_drive,
+                              p_request->drive_block,
+                              p_request->block_size);
+      }
+
+      /* Note whether a read continues a sequential stream, and       */
+      /* complete reads of cached or buffered blocks right away       */
+      else if (p_request->block_size == BYTES_PER_BLOCK)
+      {
+         p_request->sequential = detect_stream(p_request->block_number);
+         if (block_cache.capacity > 0 &&
+             (entry = find_cached_block(p_request->block_number))
+                                                            != NO_ENTRY)
+         {
+            memcpy(p_request->p_data_address,
+                   block_cache.p_data + (long)entry * BYTES_PER_BLOCK,
+                   BYTES_PER_BLOCK);
+            complete_request(p_request, 0);
+            p_request = NULL;
+         }
+         else if (read_buffered_block(p_request) == TRUE)
+            p_request = NULL;
+         else if (block_cache.capacity > 0)
+            block_cache.miss_count += 1;
+      }
+
+      /* Hand the new request to its drive                            */
+      if (p_request != NULL)
+         dispatch_request(p_request);
+      message_count += 1;
    }
 
-   /* Unlink the found request and free it's memory                   */
-   p_previous->p_next_request = p_current->p_next_request;
-   free(p_current);
+   /* Let the workers waiting on the new requests go on               */
+   intake_count += 1;
+   wake_drives();
    return;
 }
 
 /**********************************************************************/
-/*              Determines if a number is a power of two              */
+/*  Sends the file system an idle message, and copies in the new      */
+/*                      messages it sends back                        */
 /**********************************************************************/
-int power_of_two(int input_value)
+void poll_file_system()
 {
-   while(((input_value % 2) == 0) && input_value > 1)
-      input_value = input_value / 2;
-   return (input_value == 1);
+   fs_message[0].operation_code = 0;
+   fs_message[0].request_number = 0;
+   fs_message[0].block_number   = 0;
+   fs_message[0].block_size     = 0;
+   fs_message[0].p_data_address = NULL;
+   pthread_mutex_unlock(&driver_lock);
+   send_message(fs_message);
+   pthread_mutex_lock(&driver_lock);
+   copy_messages();
+   return;
+}
+
+/**********************************************************************/
+/*   Pushes a request onto its drive's inbox, waking the drive's      */
+/*                               worker                               */
+/**********************************************************************/
+void dispatch_request(REQUEST *p_request)
+{
+   DRIVE *p_drive = p_request->p_drive;
+                    /* Points to the drive holding the block          */
+
+   p_request->p_next_request = p_drive->p_inbox;
+   p_drive->p_inbox          = p_request;
+   pthread_cond_signal(&p_drive->work_ready);
+   return;
+}
+
+/**********************************************************************/
+/*  Takes every request handed to a drive off its inbox, and moves    */
+/*          them into its queue in the order they arrived             */
+/**********************************************************************/
+void drain_inbox(DRIVE *p_drive)
+{
+   REQUEST *p_request,       /* Points to a request taken off inbox   */
+           *p_next,          /* Points to the request under it        */
+           *p_oldest = NULL; /* Points to the oldest request not yet  */
+                             /* queued                                */
+
+   /* The inbox stacks the newest request first, so reverse it        */
+   p_request        = p_drive->p_inbox;
+   p_drive->p_inbox = NULL;
+   while (p_request != NULL)
+   {
+      p_next = p_request->p_next_request;
+      p_request->p_next_request = p_oldest;
+      p_oldest  = p_request;
+      p_request = p_next;
+   }
+   while ((p_request = p_oldest) != NULL)
+   {
+      p_oldest = p_request->p_next_request;
+      insert_request(p_request);
+   }
+   return;
+}
+
+/**********************************************************************/
+/*   Inserts request into the pending request queue slot for its      */
+/*                           block number                             */
+/**********************************************************************/
+void insert_request(REQUEST *p_request)
+{
+   REQUEST_QUEUE *p_queue = p_request->p_drive->p_queue;
+                       /* Points to the drive's request queue         */
+   int     slot     = p_request->drive_block;
+                       /* Queue slot of the request's block           */
+   REQUEST *p_first = p_queue->p_slot[slot],
+                       /* Points to the oldest request of the block   */
+           *p_newest,  /* Points to the newest request of the block   */
+           *p_previous;/* Points to the request arriving before       */
+
+   /* Merge a whole block request with the newest queued request for  */
+   /* its block. Merging only with the newest request keeps every     */
+   /* read seeing the writes that arrived before it                   */
+   if (p_first != NULL &&
+       p_request->block_size == BYTES_PER_BLOCK &&
+       (p_newest = p_first->p_previous_request)->block_size ==
+                                                      BYTES_PER_BLOCK)
+   {
+      /* A read of a block about to be written gets the data being    */
+      /* written                                                      */
+      if (p_request->operation_code == READ_OP_CODE &&
+          p_newest->operation_code  == WRITE_OP_CODE)
+      {
+         memcpy(p_request->p_data_address, p_newest->p_data_address,
+                BYTES_PER_BLOCK);
+         complete_request(p_request, 0);
+         statistics.forwarded_count += 1;
+         return;
+      }
+
+      /* A read of a block already being read waits on that read      */
+      if (p_request->operation_code == READ_OP_CODE)
+      {
+         p_request->p_next_duplicate = p_newest->p_next_duplicate;
+         p_newest->p_next_duplicate  = p_request;
+         statistics.duplicate_count += 1;
+         return;
+      }
+
+      /* A write overwriting a queued write completes that write      */
+      /* without it ever reaching the disk, and inherits its place    */
+      /* toward the deadline                                          */
+      if (p_newest->operation_code == WRITE_OP_CODE)
+      {
+         if (p_newest->priority == p_request->priority)
+            p_request->arrival_time = p_newest->arrival_time;
+         remove_request(p_newest);
+         complete_request(p_newest, 0);
+         statistics.absorbed_count += 1;
+         p_first = p_queue->p_slot[slot];
+      }
+   }
+
+   /* Start a new slot list, or link the request in behind the newest */
+   /* request of its block so equal blocks stay in arrival order      */
+   if (p_first == NULL)
+   {
+      p_request->p_next_request     = p_request;
+      p_request->p_previous_request = p_request;
+      p_queue->p_slot[slot] = p_request;
+      mark_slot_busy(p_queue, slot);
+   }
+   else
+   {
+      p_request->p_next_request     = p_first;
+      p_request->p_previous_request = p_first->p_previous_request;
+      p_first->p_previous_request->p_next_request = p_request;
+      p_first->p_previous_request   = p_request;
+   }
+
+   /* Append the request to its priority's arrival order list. An     */
+   /* absorbed write's arrival time may be older than requests on the */
+   /* list, so walk back to keep the list in time order               */
+   p_previous = p_queue->p_newest[p_request->priority];
+   while (p_previous != NULL &&
+          p_previous->arrival_time > p_request->arrival_time)
+      p_previous = p_previous->p_previous_arrival;
+   p_request->p_previous_arrival = p_previous;
+   if (p_previous == NULL)
+   {
+      p_request->p_next_arrival =
+         p_queue->p_oldest[p_request->priority];
+      p_queue->p_oldest[p_request->priority] = p_request;
+   }
+   else
+   {
+      p_request->p_next_arrival  = p_previous->p_next_arrival;
+      p_previous->p_next_arrival = p_request;
+   }
+   if (p_request->p_next_arrival == NULL)
+      p_queue->p_newest[p_request->priority] = p_request;
+   else
+      p_request->p_next_arrival->p_previous_arrival = p_request;
+   p_queue->request_count += 1;
+   return;
+}
+
+/**********************************************************************/
+/* Sets a slot's bit in the occupancy maps, along with the bits above */
+/*               it for the words that were empty until now           */
+/**********************************************************************/
+void mark_slot_busy(REQUEST_QUEUE *p_queue, int slot)
+{
+   int                level,     /* Index of an occupancy map         */
+                      was_empty; /* The word had no busy bit          */
+   unsigned long long *p_word;   /* Points to the word holding a bit  */
+
+   for (level = 0; level < p_queue->map_levels; level++)
+   {
+      p_word    = &p_queue->p_maps[level][slot / BITS_PER_WORD];
+      was_empty = *p_word == 0;
+      *p_word  |= 1ULL << (slot % BITS_PER_WORD);
+      if (was_empty == FALSE)
+         break;
+      slot /= BITS_PER_WORD;
+   }
+   return;
+}
+
+/**********************************************************************/
+/*  Clears a slot's bit in the occupancy maps, along with the bits    */
+/*             above it for the words that are now empty              */
+/**********************************************************************/
+void mark_slot_free(REQUEST_QUEUE *p_queue, int slot)
+{
+   int                level;   /* Index of an occupancy map           */
+   unsigned long long *p_word; /* Points to the word holding a bit    */
+
+   for (level = 0; level < p_queue->map_levels; level++)
+   {
+      p_word   = &p_queue->p_maps[level][slot / BITS_PER_WORD];
+      *p_word &= ~(1ULL << (slot % BITS_PER_WORD));
+      if (*p_word != 0)
+         break;
+      slot /= BITS_PER_WORD;
+   }
+   return;
+}
+
+/**********************************************************************/
+/*   Finds the first busy pending queue slot at or after a slot, or   */
+/*                     -1 if every slot is empty                      */
+/**********************************************************************/
+int find_busy_slot(REQUEST_QUEUE *p_queue, int first_slot)
+{
+   int                level = 0,  /* Index of an occupancy map        */
+                      index = first_slot;
+                                  /* Bit of the map looked from       */
+   unsigned long long bits;       /* Busy bits left in a word         */
+
+   if (first_slot >= geometry.block_count + MIN_BLOCK_NUMBER)
+      return -1;
+
+   /* Climb the maps until a word has a busy bit at or after the one  */
+   /* looked from, looking past each word that had none               */
+   while ((bits = p_queue->p_maps[level][index / BITS_PER_WORD] &
+                  (~0ULL << (index % BITS_PER_WORD))) == 0)
+   {
+      level += 1;
+      if (level == p_queue->map_levels)
+         return -1;
+      index = index / BITS_PER_WORD + 1;
+   }
+
+   /* Climb back down, following the first busy bit of each word      */
+   index = index / BITS_PER_WORD * BITS_PER_WORD +
+           __builtin_ctzll(bits);
+   while (level > 0)
+   {
+      level -= 1;
+      index  = index * BITS_PER_WORD +
+               __builtin_ctzll(p_queue->p_maps[level][index]);
+   }
+   return index;
+}
+
+/**********************************************************************/
+/*  Finds the last busy pending queue slot at or before a slot, or -1 */
+/*                   if every one of them is empty                    */
+/**********************************************************************/
+int find_busy_slot_below(REQUEST_QUEUE *p_queue, int last_slot)
+{
+   int                level = 0,  /* Index of an occupancy map        */
+                      index = last_slot;
+                                  /* Bit of the map looked from       */
+   unsigned long long bits;       /* Busy bits left in a word         */
+
+   if (last_slot < 0)
+      return -1;
+
+   /* Climb the maps until a word has a busy bit at or before the one */
+   /* looked from, looking before each word that had none             */
+   while ((bits = p_queue->p_maps[level][index / BITS_PER_WORD] &
+                  (~0ULL >> (BITS_PER_WORD - 1 -
+                             index % BITS_PER_WORD))) == 0)
+   {
+      level += 1;
+      if (level == p_queue->map_levels ||
+          (index = index / BITS_PER_WORD - 1) < 0)
+         return -1;
+   }
+
+   /* Climb back down, following the last busy bit of each word       */
+   index = index / BITS_PER_WORD * BITS_PER_WORD + BITS_PER_WORD - 1 -
+           __builtin_clzll(bits);
+   while (level > 0)
+   {
+      level -= 1;
+      index  = index * BITS_PER_WORD + BITS_PER_WORD - 1 -
+               __builtin_clzll(p_queue->p_maps[level][index]);
+   }
+   return index;
+}
+
+/**********************************************************************/
+/*           Gets the first pending queue slot of a cylinder          */
+/**********************************************************************/
+int cylinder_slot(int cylinder)
+{
+   if (cylinder <= 0)
+      return MIN_BLOCK_NUMBER;
+   if (cylinder >= geometry.cylinders)
+      return geometry.block_count + MIN_BLOCK_NUMBER;
+   return cylinder * geometry.blocks_per_cylinder + MIN_BLOCK_NUMBER;
+}
+
+/**********************************************************************/
+/*          Creates a new request from a file system request          */
+/**********************************************************************/
+REQUEST *create_request(MESSAGE message)
+{
+   REQUEST *p_new_request = allocate_request();
+                           /* Points to a new request                 */
+
+   /* Construct the new request from the file system message data     */
+   p_new_request->operation_code = message.operation_code;
+   p_new_request->request_number = message.request_number;
+   p_new_request->block_number   = message.block_number;
+   p_new_request->block_size     = message.block_size;
+   p_new_request->p_data_address = message.p_data_address;
+   p_new_request->p_next_duplicate = NULL;
+   p_new_request->sequential     = FALSE;
+
+   /* Time stamp the request and classify its priority                */
+   p_new_request->arrival_time   = current_time();
+#ifdef DRIVER_METRICS
+   p_new_request->event_times[ARRIVAL_EVENT]    =
+                                           p_new_request->arrival_time;
+   p_new_request->event_times[DISPATCH_EVENT]   = -1;
+   p_new_request->event_times[SEEK_EVENT]       = -1;
+   p_new_request->event_times[TRANSFER_EVENT]   = -1;
+   p_new_request->event_times[COMPLETION_EVENT] = -1;
+#endif
+   if (p_new_request->operation_code == READ_OP_CODE)
+      p_new_request->priority    = SYNC_PRIORITY;
+   else if (p_new_request->block_number <= metadata_blocks)
+      p_new_request->priority    = METADATA_PRIORITY;
+   else
+      p_new_request->priority    = BACKGROUND_PRIORITY;
+
+   /* Find the drive holding a valid block, and the block's place on  */
+   /* that drive                                                      */
+   p_new_request->p_drive        = NULL;
+   p_new_request->drive_block    = 0;
+   if (p_new_request->block_number >= MIN_BLOCK_NUMBER &&
+       p_new_request->block_number <= max_block_number)
+   {
+      p_new_request->p_drive = map_block(p_new_request->block_number,
+                                        &p_new_request->drive_block);
+      convert_block(p_new_request->drive_block,
+                   &p_new_request->cylinder_number,
+                   &p_new_request->track_number,
+                   &p_new_request->sector_number);
+   }
+   pending_count += 1;
+
+   /* Return a pointer to the new request                             */
+   return p_new_request;
+}
+
+/**********************************************************************/
+/* Converts file system block numbers to cylinder, track, and sector  */
+/*   numbers, with the cylinder's division done as a multiply and the */
+/*           track and sector looked up in the geometry               */
+/**********************************************************************/
+void convert_block(int block_number, int *p_cylinder, int *p_track,
+                   int *p_sector)
+{
+   int         index = block_number - MIN_BLOCK_NUMBER;
+                         /* Index of the block on its drive           */
+   BLOCK_PLACE *p_place; /* Points to the block's place on a cylinder */
+
+   /* Calculate the cylinder number                                   */
+   *p_cylinder = divide(&geometry.cylinder_divisor, index);
+
+   /* Look up the track and sector numbers                            */
+   p_place     = &geometry.p_places[index - *p_cylinder *
+                                    geometry.blocks_per_cylinder];
+   *p_track    = p_place->track_number;
+   *p_sector   = p_place->sector_number;
+   return;
+}
+
+/**********************************************************************/
+/*            Looks up a disk scheduling policy by its name           */
+/**********************************************************************/
+SCHEDULER *select_scheduler(char *p_name)
+{
+   SCHEDULER *p_policy = schedulers; /* Points to a scheduling policy */
+
+   /* Use the modified elevator if no policy was named                */
+   if (p_name == NULL || *p_name == '\0')
+      return schedulers;
+
+   /* Find the named policy in the scheduling policy table            */
+   while (p_policy->p_name != NULL &&
+          strcmp(p_policy->p_name, p_name) != 0)
+      p_policy += 1;
+   if (p_policy->p_name == NULL)
+   {
+      printf("\nError #%d in select_scheduler().", SCHEDULER_ERR);
+      printf("\nUnknown disk scheduling policy \"%s\".", p_name);
+      printf("\nThe program is aborting.");
+      exit(SCHEDULER_ERR);
+   }
+   return p_policy;
+}
+
+/**********************************************************************/
+/*  Gets the next request using the modified elevator algorithm. The  */
+/*  heads only sweep upward, wrapping around to the lowest block, so  */
+/*        this serves as both C-LOOK and, with the sweep to the       */
+/*                       disk's edge, C-SCAN                          */
+/**********************************************************************/
+REQUEST *get_clook_request(DRIVE *p_drive)
+{
+   int slot = find_busy_slot(p_drive->p_queue,
+                             cylinder_slot(p_drive->current_cylinder));
+            /* First busy slot at or above the current cylinder       */
+
+   /* Return the lowest block if no block is above the heads          */
+   if (slot < 0)
+      slot = find_busy_slot(p_drive->p_queue, MIN_BLOCK_NUMBER);
+
+   /* Return a pointer to the oldest request of the found block       */
+   return p_drive->p_queue->p_slot[slot];
+}
+
+/**********************************************************************/
+/*   Gets the next request using the elevator algorithm, sweeping up  */
+/*     and down and reversing when no request is ahead of the heads   */
+/**********************************************************************/
+REQUEST *get_look_request(DRIVE *p_drive)
+{
+   REQUEST_QUEUE *p_queue = p_drive->p_queue;
+                           /* Points to the drive's request queue     */
+   int     cylinder = p_drive->current_cylinder,
+                           /* Cylinder the heads are on               */
+           slot     = -1;  /* Busy slot found ahead of the heads      */
+
+   /* Look ahead in the sweep direction, then reverse if needed       */
+   if (p_drive->look_direction > 0 &&
+       (slot = find_busy_slot(p_queue, cylinder_slot(cylinder))) < 0)
+      p_drive->look_direction = -1;
+   if (p_drive->look_direction < 0 &&
+       (slot = find_busy_slot_below(p_queue,
+                                    cylinder_slot(cylinder + 1) - 1))
+                                                                   < 0)
+   {
+      p_drive->look_direction = 1;
+      slot = find_busy_slot(p_queue, cylinder_slot(cylinder));
+   }
+
+   /* Return the lowest block request on the found cylinder           */
+   return get_cylinder_request(p_queue,
+                               p_queue->p_slot[slot]->cylinder_number);
+}
+
+/**********************************************************************/
+/*     Gets the request on the cylinder nearest the heads, breaking   */
+/*                        ties toward the top                         */
+/**********************************************************************/
+REQUEST *get_sstf_request(DRIVE *p_drive)
+{
+   REQUEST_QUEUE *p_queue = p_drive->p_queue;
+               /* Points to the drive's request queue                 */
+   int cylinder = p_drive->current_cylinder,
+               /* Cylinder the heads are on                           */
+       above = find_busy_slot(p_queue, cylinder_slot(cylinder)),
+               /* First busy slot at or above the heads               */
+       below = find_busy_slot_below(p_queue,
+                                    cylinder_slot(cylinder) - 1);
+               /* Last busy slot below the heads                      */
+
+   /* Take the nearer of the cylinders above and below the heads      */
+   if (above < 0 ||
+       (below >= 0 &&
+        cylinder - p_queue->p_slot[below]->cylinder_number <
+        p_queue->p_slot[above]->cylinder_number - cylinder))
+      return get_cylinder_request(p_queue,
+                p_queue->p_slot[below]->cylinder_number);
+   return p_queue->p_slot[above];
+}
+
+/**********************************************************************/
+/*    Gets the oldest request, breaking ties toward the more urgent   */
+/*   priority. A request for the same block that arrived in the same  */
+/*    exchange may be ahead of it, so its block's oldest request is   */
+/*                            served first                            */
+/**********************************************************************/
+REQUEST *get_fcfs_request(DRIVE *p_drive)
+{
+   REQUEST *p_oldest = NULL, /* Points to the oldest request found    */
+           *p_request;       /* Points to a priority's oldest request */
+   int     priority;         /* Index of a priority class             */
+
+   for (priority = 0; priority < PRIORITY_CLASSES; priority++)
+      if ((p_request = p_drive->p_queue->p_oldest[priority])
+                                                             != NULL &&
+          (p_oldest == NULL ||
+           p_request->arrival_time < p_oldest->arrival_time))
+         p_oldest = p_request;
+   return p_oldest == NULL ? NULL :
+                  p_drive->p_queue->p_slot[p_oldest->drive_block];
+}
+
+/**********************************************************************/
+/*  Gets the oldest request of the most urgent priority class whose   */
+/*   deadline has been reached, or NULL if every request still has    */
+/*   time. If older requests for the same block are ahead of it, the  */
+/*  oldest of them is served first, so a block's requests still reach */
+/*                     the disk in arrival order                      */
+/**********************************************************************/
+REQUEST *get_expired_request(DRIVE *p_drive)
+{
+   REQUEST   *p_request;          /* Points to a priority's oldest    */
+   long long now = current_time();/* Time the deadlines are checked   */
+   int       priority;            /* Index of a priority class        */
+
+   for (priority = 0; priority < PRIORITY_CLASSES; priority++)
+      if ((p_request = p_drive->p_queue->p_oldest[priority])
+                                                             != NULL &&
+          priority_classes[priority].deadline > 0 &&
+          now - p_request->arrival_time >=
+                                   priority_classes[priority].deadline)
+      {
+         priority_classes[priority].expired_count += 1;
+         return p_drive->p_queue->p_slot[p_request->drive_block];
+      }
+   return NULL;
+}
+
+/**********************************************************************/
+/*             Gets the lowest block request on a cylinder            */
+/**********************************************************************/
+REQUEST *get_cylinder_request(REQUEST_QUEUE *p_queue, int cylinder)
+{
+   return p_queue->p_slot[find_busy_slot(p_queue,
+                                         cylinder_slot(cylinder))];
+}
+
+/**********************************************************************/
+/*  Gets the request on the heads' cylinder whose first sector will   */
+/*   rotate under the heads soonest, counting the sectors that pass   */
+/*                while the transfer is being set up                  */
+/**********************************************************************/
+REQUEST *get_rotational_request(DRIVE *p_drive)
+{
+   REQUEST_QUEUE *p_queue = p_drive->p_queue;
+                                /* Points to the drive's queue        */
+   REQUEST *p_best      = NULL; /* Points to the soonest request      */
+   int     cylinder     = p_drive->current_cylinder,
+                                /* Cylinder the heads are on          */
+           last_slot    = cylinder_slot(cylinder + 1) - 1,
+                                /* Last queue slot on the cylinder    */
+           slot         = find_busy_slot(p_queue,
+                                         cylinder_slot(cylinder)),
+                                /* A busy slot on the cylinder        */
+           best_wait    = geometry.sectors_per_track,
+                                /* Sectors to wait for the soonest    */
+           wait;                /* Sectors to wait for a request      */
+
+   /* Find the cylinder's request with the shortest rotational wait   */
+   while (slot >= 0 && slot <= last_slot)
+   {
+      wait = p_queue->p_slot[slot]->sector_number -
+             p_drive->rotational_sector - rotational_skew;
+      wait = (wait % geometry.sectors_per_track +
+              geometry.sectors_per_track) % geometry.sectors_per_track;
+      if (p_best == NULL || wait < best_wait)
+      {
+         p_best    = p_queue->p_slot[slot];
+         best_wait = wait;
+      }
+      slot = find_busy_slot(p_queue, slot + 1);
+   }
+
+   /* Count the requests served out of block order                    */
+   if (p_best != get_cylinder_request(p_queue, cylinder))
+      statistics.rotational_count += 1;
+   return p_best;
+}
+
+/**********************************************************************/
+/*  Seeks a drive's heads to a cylinder, recalibrating them and       */
+/*  backing off after each seek that misses, and adds the distance    */
+/*  traveled to the drive's total. Returns FALSE if the heads still   */
+/*           missed the cylinder once the retries ran out             */
+/**********************************************************************/
+int seek_cylinder(DRIVE *p_drive, int cylinder)
+{
+   int new_cylinder, /* Cylinder the heads landed on                  */
+       retries = 0;  /* Recalibrations made so far                    */
+
+   /* A seek leaves the heads at an unknown rotational position       */
+   if (p_drive->current_cylinder != cylinder)
+      p_drive->rotational_sector = -1;
+   while (p_drive->current_cylinder != cylinder)
+   {
+      new_cylinder = drive_command(p_drive, SEEK_CYLINDER, cylinder,
+                                   0, 0, 0);
+      p_drive->seek_distance +=
+         abs(new_cylinder - p_drive->current_cylinder);
+      p_drive->current_cylinder = new_cylinder;
+      if (p_drive->current_cylinder != cylinder)
+      {
+         if (retries == retry_policy.seek_retries)
+            return FALSE;
+         retries                    += 1;
+         p_drive->recalibrate_count += 1;
+         back_off(retries);
+         new_cylinder = drive_command(p_drive, RECALIBRATE, 0, 0, 0, 0);
+         p_drive->seek_distance +=
+            abs(new_cylinder - p_drive->current_cylinder);
+         p_drive->current_cylinder = new_cylinder;
+      }
+   }
+   return TRUE;
+}
+
+/**********************************************************************/
+/*          Removes a request from the pending request queue          */
+/**********************************************************************/
+void remove_request(REQUEST *p_request)
+{
+   REQUEST_QUEUE *p_queue = p_request->p_drive->p_queue;
+            /* Points to the drive's request queue                    */
+   int slot = p_request->drive_block;
+            /* Queue slot of the request's block                      */
+
+   /* Empty the slot if this was the only request for its block,      */
+   /* otherwise unlink the request from the slot list                 */
+   if (p_request->p_next_request == p_request)
+   {
+      p_queue->p_slot[slot] = NULL;
+      mark_slot_free(p_queue, slot);
+   }
+   else
+   {
+      p_request->p_previous_request->p_next_request =
+         p_request->p_next_request;
+      p_request->p_next_request->p_previous_request =
+         p_request->p_previous_request;
+      if (p_queue->p_slot[slot] == p_request)
+         p_queue->p_slot[slot] = p_request->p_next_request;
+   }
+
+   /* Unlink the request from its priority's arrival order list       */
+   if (p_request->p_previous_arrival == NULL)
+      p_queue->p_oldest[p_request->priority] =
+         p_request->p_next_arrival;
+   else
+      p_request->p_previous_arrival->p_next_arrival =
+         p_request->p_next_arrival;
+   if (p_request->p_next_arrival == NULL)
+      p_queue->p_newest[p_request->priority] =
+         p_request->p_previous_arrival;
+   else
+      p_request->p_next_arrival->p_previous_arrival =
+         p_request->p_previous_arrival;
+   p_queue->request_count -= 1;
+   return;
+}
+
+/**********************************************************************/
+/*                Allocates the fixed pool of requests                */
+/**********************************************************************/
+void create_request_pool(int capacity)
+{
+   int request; /* Index of a request in the pool                     */
+
+   /* Get cache line aligned storage for every request in the pool    */
+   if (posix_memalign((void **)&request_pool.p_requests,
+                      CACHE_LINE_SIZE, capacity * sizeof(REQUEST)) != 0)
+   {
+      printf("\nError #%d in create_request_pool().", POOL_ALLOC_ERR);
+      printf("\nCannot allocate enough memory for the request pool.");
+      printf("\nThe program is aborting.");
+      exit(POOL_ALLOC_ERR);
+   }
+   request_pool.capacity        = capacity;
+   request_pool.in_use          = 0;
+   request_pool.high_water_mark = 0;
+   request_pool.exhausted_count = 0;
+
+   /* Push the requests onto the free stack, lowest address on top    */
+   request_pool.p_free_requests = NULL;
+   for (request = capacity - 1; request >= 0; request--)
+   {
+      request_pool.p_requests[request].p_next_request =
+         request_pool.p_free_requests;
+      request_pool.p_free_requests = &request_pool.p_requests[request];
+   }
+   return;
+}
+
+/**********************************************************************/
+/*               Takes a request from the request pool                */
+/**********************************************************************/
+REQUEST *allocate_request()
+{
+   REQUEST *p_request = request_pool.p_free_requests;
+                        /* Points to the allocated request            */
+
+   /* Pop the free stack, or fall back to the heap if the queue has   */
+   /* outgrown the pool so the driver keeps running. Heap requests    */
+   /* are cache line aligned just like the pool's                     */
+   if (p_request != NULL)
+      request_pool.p_free_requests = p_request->p_next_request;
+   else
+   {
+      request_pool.exhausted_count += 1;
+      if (posix_memalign((void **)&p_request, CACHE_LINE_SIZE,
+                         sizeof(REQUEST)) != 0)
+      {
+         printf("\nError #%d in allocate_request().",
+                REQUEST_ALLOC_ERR);
+         printf("\nCannot allocate enough memory for a new request.");
+         printf("\nThe program is aborting.");
+         exit(REQUEST_ALLOC_ERR);
+      }
+   }
+
+   /* Track the pool's high water mark                                */
+   request_pool.in_use += 1;
+   if (request_pool.in_use > request_pool.high_water_mark)
+      request_pool.high_water_mark = request_pool.in_use;
+   return p_request;
+}
+
+/**********************************************************************/
+/*                Returns a request to the request pool               */
+/**********************************************************************/
+void free_request(REQUEST *p_request)
+{
+   /* Push pool requests back on the free stack, and free any request */
+   /* that came from the heap when the pool was exhausted             */
+   if (p_request >= request_pool.p_requests &&
+       p_request <  request_pool.p_requests + request_pool.capacity)
+   {
+      p_request->p_next_request    = request_pool.p_free_requests;
+      request_pool.p_free_requests = p_request;
+   }
+   else
+      free(p_request);
+   request_pool.in_use -= 1;
+   return;
+}
+
+/**********************************************************************/
+/*        Gets an integer setting from the environment, or the        */
+/*               default value if the setting is not set              */
+/**********************************************************************/
+int get_config_value(char *p_name, int default_value)
+{
+   char *p_value = getenv(p_name); /* Points to the setting's text    */
+
+   if (p_value == NULL || *p_value == '\0')
+      return default_value;
+   return atoi(p_value);
+}
+
+/**********************************************************************/
+/*                    Prints the driver statistics                    */
+/**********************************************************************/
+void print_statistics()
+{
+   DRIVE *p_drive;          /* Points to a drive                      */
+   MOTOR_POLICY *p_policy;  /* Points to a drive's motor policy       */
+   int   priority;          /* Index of a priority class              */
+   long  seek_distance = 0, /* Cylinders seeked on every drive        */
+         transfer_count = 0;/* Transfers on every drive               */
+
+   fprintf(stderr, "\nRequest pool: %d requests, %d high water mark,"
+                   " %d exhausted allocations\n",
+           request_pool.capacity, request_pool.high_water_mark,
+           request_pool.exhausted_count);
+   fprintf(stderr, "Drives: %d, %d blocks, ", drive_count,
+           max_block_number);
+   if (stripe_blocks == 0)
+      fprintf(stderr, "concatenated\n");
+   else
+      fprintf(stderr, "striped %d blocks at a time\n", stripe_blocks);
+   for (p_drive = p_drives; p_drive < p_drives + drive_count;
+        p_drive++)
+   {
+      p_policy        = &p_drive->motor_policy;
+      seek_distance  += p_drive->seek_distance;
+      transfer_count += p_drive->transfer_count;
+      fprintf(stderr, "Drive %d: %ld cylinders of seek distance, %ld"
+                      " recalibrations, %ld transfers, %ld checksum"
+                      " retries, motor %ld spin-ups adding %.3f ms,"
+                      " %ld avoided, %.3f ms spin-down timeout\n",
+              p_drive->unit, p_drive->seek_distance,
+              p_drive->recalibrate_count, p_drive->transfer_count,
+              p_drive->checksum_retry_count, p_policy->spin_up_count,
+              p_policy->spin_up_time / 1000.0, p_policy->avoided_count,
+              p_policy->timeout / 1000.0);
+   }
+   fprintf(stderr, "Scheduler: %s, %ld cylinders of seek distance\n",
+           p_scheduler->p_name, seek_distance);
+   fprintf(stderr, "Transfers: %ld, with %ld coalesced requests\n",
+           transfer_count, statistics.coalesced_count);
+   fprintf(stderr, "Rotational ordering: %ld requests moved ahead\n",
+           statistics.rotational_count);
+   fprintf(stderr, "Queue merging: %ld writes absorbed, %ld reads"
+                   " served from queued writes, %ld duplicate reads\n",
+           statistics.absorbed_count, statistics.forwarded_count,
+           statistics.duplicate_count);
+   fprintf(stderr, "Validation: %ld invalid requests completed at"
+                   " intake\n", statistics.rejected_count);
+   fprintf(stderr, "Retries: up to %d per seek and %d per transfer,"
+                   " %ld failed seeks, %ld failed transfers, %ld"
+                   " refused DMA setups, %ld requests failed\n",
+           retry_policy.seek_retries, retry_policy.transfer_retries,
+           statistics.seek_failure_count,
+           statistics.checksum_failure_count,
+           statistics.dma_failure_count, statistics.failed_count);
+   fprintf(stderr, "Intake: %s, %ld polls while the drives were busy,"
+                   " %.3f ms mean and %.3f ms longest queue wait\n",
+           pipelined == TRUE ? "pipelined" : "serial",
+           statistics.poll_count,
+           statistics.queued_count > 0 ?
+              statistics.queue_wait / 1000.0 / statistics.queued_count :
+              0.0,
+           statistics.longest_queue_wait / 1000.0);
+   fprintf(stderr, "Completion delivery: %ld messages, batches of up"
+                   " to %d, %.3f ms hold time\n",
+           statistics.delivery_count, completed_requests.batch_size,
+           completed_requests.hold_time / 1000.0);
+   for (priority = 0; priority < PRIORITY_CLASSES; priority++)
+      fprintf(stderr, "Deadline for %s: %.3f ms, %ld requests, %ld"
+                      " served at deadline, %ld missed, %.3f ms"
+                      " longest wait\n",
+              priority_classes[priority].p_name,
+              priority_classes[priority].deadline / 1000.0,
+              priority_classes[priority].request_count,
+              priority_classes[priority].expired_count,
+              priority_classes[priority].miss_count,
+              priority_classes[priority].longest_wait / 1000.0);
+   fprintf(stderr, "Read-ahead: %d of %d block window, %ld blocks read"
+                   " ahead, %ld used, %ld wasted, %ld reads served from"
+                   " track buffers\n",
+           read_ahead.window, read_ahead.max_window,
+           read_ahead.prefetch_count, read_ahead.useful_count,
+           read_ahead.wasted_count, read_ahead.hit_count);
+   if (block_cache.capacity > 0)
+      fprintf(stderr, "Block cache: %d blocks, %ld hits, %ld misses,"
+                      " %ld evictions\n",
+              block_cache.capacity, block_cache.hit_count,
+              block_cache.miss_count, block_cache.eviction_count);
+#ifdef DRIVER_METRICS
+   write_metrics(stderr, FALSE);
+#endif
+   return;
+}
+
+/**********************************************************************/
+/*     Validates a request, returning the sum of its error codes      */
+/**********************************************************************/
+int validate_request(REQUEST *p_request)
+{
+   int error_code = 0; /* Tracks errors for the request               */
+
+   /* Validate the operation code of the request                      */
+   if (p_request->operation_code != READ_OP_CODE &&
+       p_request->operation_code != WRITE_OP_CODE)
+      error_code += OP_CODE_ERROR;
+
+   /* Validate the request number of the request                      */
+   if (p_request->request_number < MIN_REQUEST_NUMBER)
+      error_code += REQUEST_NUM_ERROR;
+
+   /* Validate the block number of the request                        */
+   if (p_request->block_number < MIN_BLOCK_NUMBER ||
+       p_request->block_number > max_block_number)
+      error_code += BLOCK_NUM_ERROR;
+
+   /* Validate the block size of the request                          */
+   if (p_request->block_size > geometry.bytes_per_cylinder ||
+       power_of_two(p_request->block_size) != TRUE)
+      error_code += BLOCK_SIZE_ERROR;
+
+   /* Validate the data address of the request                        */
+   if (p_request->p_data_address == NULL)
+      error_code += DATA_ADDRESS_ERROR;
+   return error_code;
+}
+
+/**********************************************************************/
+/*  Gathers the requests for the blocks following the first request   */
+/*  in a run, as long as they are on the same cylinder, go the same   */
+/*    way and are whole blocks. Blocks on a cylinder lie in one       */
+/*   continuous stretch of sectors, so the run is one DMA transfer.   */
+/*  A read also takes in up to the read-ahead count of blocks nobody  */
+/*  asked for, both between its requests and after them, which are    */
+/*              left in the run as NULL request pointers              */
+/**********************************************************************/
+int find_request_run(REQUEST *p_run[], int read_ahead)
+{
+   REQUEST *p_first    = p_run[0], /* Points to the first request     */
+           **p_slot    = p_first->p_drive->p_queue->p_slot,
+                                   /* Points to the drive's queue     */
+                                   /* slots                           */
+           *p_next;                /* Points to the next block's      */
+                                   /* oldest request                  */
+   int     run_length  = 1,        /* Number of blocks in the run     */
+           last_request = 1,       /* Run length up to the last       */
+                                   /* request in it                   */
+           end_block   = cylinder_slot(p_first->cylinder_number + 1);
+                                   /* First block past the cylinder   */
+
+   if (p_first->block_size != BYTES_PER_BLOCK)
+      return run_length;
+   if (p_first->operation_code != READ_OP_CODE)
+      read_ahead = 0;
+   while (run_length < geometry.blocks_per_cylinder &&
+          p_first->drive_block + run_length < end_block)
+   {
+      p_next = p_slot[p_first->drive_block + run_length];
+      if (p_next != NULL &&
+          p_next->operation_code == p_first->operation_code &&
+          p_next->block_size     == BYTES_PER_BLOCK)
+      {
+         p_run[run_length] = p_next;
+         run_length       += 1;
+         last_request      = run_length;
+         statistics.coalesced_count += 1;
+      }
+      else if (p_next == NULL && run_length - last_request < read_ahead)
+      {
+         p_run[run_length] = NULL;
+         run_length       += 1;
+      }
+      else
+         break;
+   }
+   return run_length;
+}
+
+/**********************************************************************/
+/*  Reads or writes a run of adjacent blocks in one transfer. A run   */
+/*    of more than one block goes through a track buffer, which is    */
+/*  gathered from or scattered to each request's data block. A        */
+/*  transfer that fails its checksum is backed off and repeated until */
+/*  the retries run out. Returns 0, or the error the run fails with   */
+/**********************************************************************/
+int transfer_requests(REQUEST *p_run[], int run_length,
+                      TRACK_BUFFER *p_buffer)
+{
+   REQUEST           *p_first = p_run[0];
+                               /* Points to the first request         */
+   DRIVE             *p_drive = p_first->p_drive;
+                               /* Points to the request's drive       */
+   unsigned long int *p_data  = p_first->p_data_address;
+                               /* Points to the memory transferred    */
+   int               run_index,/* Index of a request in the run       */
+                     checksum, /* Checksum returned from the disk     */
+                     retries = 0;
+                               /* Transfers repeated so far           */
+
+   /* Gather the blocks being written into the transfer buffer        */
+   if (run_length > 1)
+   {
+      p_data = p_buffer->p_data;
+      if (p_first->operation_code == WRITE_OP_CODE)
+         for (run_index = 0; run_index < run_length; run_index++)
+            memcpy((char *)p_buffer->p_data +
+                      run_index * BYTES_PER_BLOCK,
+                   p_run[run_index]->p_data_address, BYTES_PER_BLOCK);
+   }
+
+   /* Set the DMA chip registers, failing the run if the disk         */
+   /* controller refuses them                                         */
+   if (drive_command(p_drive, DMA_SETUP, p_first->sector_number,
+                     p_first->track_number,
+                     run_length == 1 ? p_first->block_size :
+                        run_length * BYTES_PER_BLOCK,
+                     p_data)
+       == DMA_SETUP_ERROR)
+      return DMA_FAILED_ERROR;
+
+   /* Read or write to the disk, backing off and repeating the        */
+   /* transfer after each checksum error until the retries run out    */
+   while ((checksum = drive_command(p_drive,
+                         p_first->operation_code == READ_OP_CODE ?
+                            READ_DISK : WRITE_DISK, 0, 0, 0, 0))
+                                                    == CHECKSUM_ERROR &&
+          retries < retry_policy.transfer_retries)
+   {
+      retries                       += 1;
+      p_drive->checksum_retry_count += 1;
+      back_off(retries);
+   }
+   p_drive->transfer_count += 1;
+   if (checksum == CHECKSUM_ERROR)
+   {
+      p_drive->rotational_sector = -1;
+      return CHECKSUM_FAILED_ERROR;
+   }
+
+   /* The heads are now just past the last sector transferred         */
+   p_drive->rotational_sector =
+      (p_first->sector_number +
+       (run_length == 1 ? p_first->block_size :
+          run_length * BYTES_PER_BLOCK) / BYTES_PER_SECTOR) %
+      geometry.sectors_per_track;
+
+   /* Scatter the blocks read to each request's data block            */
+   if (run_length > 1 && p_first->operation_code == READ_OP_CODE)
+      for (run_index = 0; run_index < run_length; run_index++)
+         if (p_run[run_index] != NULL)
+            memcpy(p_run[run_index]->p_data_address,
+                   (char *)p_buffer->p_data +
+                      run_index * BYTES_PER_BLOCK,
+                   BYTES_PER_BLOCK);
+   return 0;
+}
+
+/**********************************************************************/
+/*     Queues a completed request to be sent to the file system       */
+/**********************************************************************/
+void complete_request(REQUEST *p_request, int error_code)
+{
+   PRIORITY_CLASS *p_class = &priority_classes[p_request->priority];
+                              /* Points to the request's priority     */
+   long long      wait     = current_time() - p_request->arrival_time;
+                              /* Time from arrival to completion      */
+
+   /* Note whether the request met its priority's deadline            */
+   p_class->request_count += 1;
+   if (wait > p_class->longest_wait)
+      p_class->longest_wait = wait;
+   if (p_class->deadline > 0 && wait > p_class->deadline)
+      p_class->miss_count += 1;
+
+   pending_count            -= 1;
+   p_request->error_code     = error_code;
+   p_request->p_next_request = NULL;
+#ifdef DRIVER_METRICS
+   p_request->event_times[COMPLETION_EVENT] =
+                                       p_request->arrival_time + wait;
+   record_completion(p_request);
+#endif
+   if (completed_requests.p_last == NULL)
+   {
+      completed_requests.p_first    = p_request;
+      completed_requests.first_time = current_time();
+   }
+   else
+      completed_requests.p_last->p_next_request = p_request;
+   completed_requests.p_last         = p_request;
+   completed_requests.request_count += 1;
+   return;
+}
+
+/**********************************************************************/
+/*  Completes the reads that were waiting on a read of the same block */
+/*          with a copy of the block it read and its result           */
+/**********************************************************************/
+void complete_duplicates(REQUEST *p_request)
+{
+   REQUEST *p_duplicate; /* Points to a waiting read                  */
+
+   while ((p_duplicate = p_request->p_next_duplicate) != NULL)
+   {
+      p_request->p_next_duplicate = p_duplicate->p_next_duplicate;
+      if (p_request->error_code == 0)
+         memcpy(p_duplicate->p_data_address, p_request->p_data_address,
+                BYTES_PER_BLOCK);
+      else
+         statistics.failed_count += 1;
+      complete_request(p_duplicate, p_request->error_code);
+   }
+   return;
+}
+
+/**********************************************************************/
+/*   Sends the completed requests to the file system a batch at a     */
+/*  time, copying in the new messages the file system sends back. A   */
+/*   batch smaller than the messages array ends with a message whose  */
+/*                      request number is zero                        */
+/**********************************************************************/
+void deliver_completions()
+{
+   REQUEST *p_request;   /* Points to the completed request           */
+   int     message;      /* Index of the message being filled         */
+
+   while (completed_requests.p_first != NULL)
+   {
+      /* Take a batch of the oldest completed requests off the queue  */
+      message = 0;
+      while (message < completed_requests.batch_size &&
+             (p_request = completed_requests.p_first) != NULL)
+      {
+         completed_requests.p_first = p_request->p_next_request;
+         completed_requests.request_count -= 1;
+         fs_message[message].operation_code = p_request->error_code;
+         fs_message[message].request_number = p_request->request_number;
+         fs_message[message].block_number   = p_request->block_number;
+         fs_message[message].block_size     = p_request->block_size;
+         fs_message[message].p_data_address = p_request->p_data_address;
+         free_request(p_request);
+         message += 1;
+      }
+      if (completed_requests.p_first == NULL)
+         completed_requests.p_last = NULL;
+      else
+         completed_requests.first_time = current_time();
+      if (message < FS_MESSAGE_COUNT)
+      {
+         fs_message[message].operation_code = 0;
+         fs_message[message].request_number = 0;
+      }
+
+      /* Send the batch to the file system and copy in the new        */
+      /* messages                                                     */
+      statistics.delivery_count += 1;
+#ifdef DRIVER_METRICS
+      take_metrics_snapshot();
+#endif
+      pthread_mutex_unlock(&driver_lock);
+      send_message (fs_message);
+      pthread_mutex_lock(&driver_lock);
+      copy_messages();
+   }
+   completed_requests.due = FALSE;
+   return;
+}
+
+/**********************************************************************/
+/*  Determines if the completed requests should be sent now: when a   */
+/*  batch is full, when the oldest has waited the hold time, when the */
+/*  drive has nothing left to do, or when its heads are about to      */
+/*                         leave the cylinder                         */
+/**********************************************************************/
+int completions_due(DRIVE *p_drive)
+{
+   int busy_slot; /* Next busy queue slot from the heads' cylinder    */
+
+   if (completed_requests.p_first == NULL)
+      return FALSE;
+   busy_slot = find_busy_slot(p_drive->p_queue,
+                              cylinder_slot(p_drive->current_cylinder));
+   return completed_requests.request_count >=
+                                      completed_requests.batch_size ||
+          current_time() - completed_requests.first_time >=
+                                      completed_requests.hold_time ||
+          busy_slot < 0 ||
+          busy_slot >= cylinder_slot(p_drive->current_cylinder + 1);
+}
+
+/**********************************************************************/
+/*   Allocates the block cache, which stays empty if its capacity is  */
+/*                               zero                                 */
+/**********************************************************************/
+void create_block_cache(int capacity, char *p_policy_name)
+{
+   int entry; /* Index of a block cache entry                         */
+
+   /* Look up the eviction policy                                     */
+   if (p_policy_name == NULL || *p_policy_name == '\0' ||
+       strcmp(p_policy_name, "lru") == 0)
+      block_cache.eviction_policy = LRU_EVICTION;
+   else if (strcmp(p_policy_name, "clock") == 0)
+      block_cache.eviction_policy = CLOCK_EVICTION;
+   else
+   {
+      printf("\nError #%d in create_block_cache().", CACHE_POLICY_ERR);
+      printf("\nUnknown cache eviction policy \"%s\".", p_policy_name);
+      printf("\nThe program is aborting.");
+      exit(CACHE_POLICY_ERR);
+   }
+
+   /* Get the map from blocks to cache entries, which every block     */
+   /* lookup goes through, and mark every block as uncached. An empty */
+   /* cache needs no map, and no block is ever looked up in it        */
+   block_cache.capacity = capacity > 0 ? capacity : 0;
+   if (block_cache.capacity == 0)
+      return;
+   if ((block_cache.p_entry_of_block = (int *)malloc(
+                   (max_block_number + 1) * sizeof(int))) == NULL)
+   {
+      printf("\nError #%d in create_block_cache().", CACHE_ALLOC_ERR);
+      printf("\nCannot allocate enough memory for the block cache.");
+      printf("\nThe program is aborting.");
+      exit(CACHE_ALLOC_ERR);
+   }
+   for (entry = 0; entry <= max_block_number; entry++)
+      block_cache.p_entry_of_block[entry] = NO_ENTRY;
+
+   /* Get the cache entries and the memory for their blocks           */
+   if ((block_cache.p_entries = (CACHE_ENTRY *)malloc(capacity *
+                                   sizeof(CACHE_ENTRY))) == NULL ||
+       posix_memalign((void **)&block_cache.p_data, CACHE_LINE_SIZE,
+                      (long)capacity * BYTES_PER_BLOCK) != 0)
+   {
+      printf("\nError #%d in create_block_cache().", CACHE_ALLOC_ERR);
+      printf("\nCannot allocate enough memory for the block cache.");
+      printf("\nThe program is aborting.");
+      exit(CACHE_ALLOC_ERR);
+   }
+
+   /* Mark every entry as free                                        */
+   for (entry = 0; entry < capacity; entry++)
+      block_cache.p_entries[entry].block_number = 0;
+   block_cache.used_count   = 0;
+   block_cache.clock_hand   = 0;
+   block_cache.most_recent  = NO_ENTRY;
+   block_cache.least_recent = NO_ENTRY;
+   return;
+}
+
+/**********************************************************************/
+/*    Looks a block up in the block cache, marking it as just used,   */
+/*         and returns its cache entry or NO_ENTRY on a miss          */
+/**********************************************************************/
+int find_cached_block(int block_number)
+{
+   int entry = block_cache.p_entry_of_block[block_number];
+             /* Block cache entry holding the block                   */
+
+   if (entry != NO_ENTRY)
+   {
+      use_cache_entry(entry);
+      block_cache.hit_count += 1;
+   }
+   return entry;
+}
+
+/**********************************************************************/
+/*    Stores a copy of a block in the block cache, evicting another   */
+/*                    block if the cache is full                      */
+/**********************************************************************/
+void cache_block(int block_number, unsigned long int *p_data)
+{
+   int entry = block_cache.p_entry_of_block[block_number];
+             /* Block cache entry to hold the block                   */
+
+   /* Take a never used entry, linking it in as the least recently    */
+   /* used, or evict a block to make room                             */
+   if (entry == NO_ENTRY)
+   {
+      if (block_cache.used_count < block_cache.capacity)
+      {
+         entry = block_cache.used_count;
+         block_cache.used_count += 1;
+         block_cache.p_entries[entry].next_entry     = NO_ENTRY;
+         block_cache.p_entries[entry].previous_entry =
+            block_cache.least_recent;
+         if (block_cache.least_recent == NO_ENTRY)
+            block_cache.most_recent = entry;
+         else
+            block_cache.p_entries[block_cache.least_recent].next_entry =
+               entry;
+         block_cache.least_recent = entry;
+      }
+      else
+         entry = evict_cache_entry();
+      block_cache.p_entries[entry].block_number = block_number;
+      block_cache.p_entry_of_block[block_number]  = entry;
+   }
+
+   /* Copy the block into the cache                                   */
+   memcpy(block_cache.p_data + (long)entry * BYTES_PER_BLOCK, p_data,
+          BYTES_PER_BLOCK);
+   use_cache_entry(entry);
+   return;
+}
+
+/**********************************************************************/
+/*   Drops a block from the block cache. The entry keeps its place    */
+/*  but is moved to the end of the LRU order so it is reused first    */
+/**********************************************************************/
+void uncache_block(int block_number)
+{
+   CACHE_ENTRY *p_entries = block_cache.p_entries;
+                            /* Points to the block cache entries      */
+   int         entry      = block_cache.p_entry_of_block[block_number];
+                            /* Block cache entry holding the block    */
+
+   if (entry == NO_ENTRY)
+      return;
+   block_cache.p_entry_of_block[block_number] = NO_ENTRY;
+   p_entries[entry].block_number = 0;
+   p_entries[entry].referenced   = FALSE;
+   if (block_cache.eviction_policy == LRU_EVICTION &&
+       entry != block_cache.least_recent)
+   {
+      /* Unlink the entry and relink it as the least recently used    */
+      if (p_entries[entry].previous_entry == NO_ENTRY)
+         block_cache.most_recent = p_entries[entry].next_entry;
+      else
+         p_entries[p_entries[entry].previous_entry].next_entry =
+            p_entries[entry].next_entry;
+      p_entries[p_entries[entry].next_entry].previous_entry =
+         p_entries[entry].previous_entry;
+      p_entries[entry].previous_entry = block_cache.least_recent;
+      p_entries[entry].next_entry     = NO_ENTRY;
+      p_entries[block_cache.least_recent].next_entry = entry;
+      block_cache.least_recent = entry;
+   }
+   return;
+}
+
+/**********************************************************************/
+/*                Marks a block cache entry as just used              */
+/**********************************************************************/
+void use_cache_entry(int entry)
+{
+   CACHE_ENTRY *p_entries = block_cache.p_entries;
+                            /* Points to the block cache entries      */
+
+   /* CLOCK only needs the reference bit set                          */
+   p_entries[entry].referenced = TRUE;
+   if (block_cache.eviction_policy != LRU_EVICTION ||
+       entry == block_cache.most_recent)
+      return;
+
+   /* Unlink the entry from its place in the LRU order                */
+   p_entries[p_entries[entry].previous_entry].next_entry =
+      p_entries[entry].next_entry;
+   if (p_entries[entry].next_entry == NO_ENTRY)
+      block_cache.least_recent = p_entries[entry].previous_entry;
+   else
+      p_entries[p_entries[entry].next_entry].previous_entry =
+         p_entries[entry].previous_entry;
+
+   /* Relink it at the front as the most recently used                */
+   p_entries[entry].previous_entry = NO_ENTRY;
+   p_entries[entry].next_entry     = block_cache.most_recent;
+   p_entries[block_cache.most_recent].previous_entry = entry;
+   block_cache.most_recent = entry;
+   return;
+}
+
+/**********************************************************************/
+/*   Frees a block cache entry for a new block, taking a dropped or   */
+/*   the least recently used entry under LRU, or sweeping the CLOCK   */
+/*       hand past referenced entries to the first unreferenced one   */
+/**********************************************************************/
+int evict_cache_entry()
+{
+   CACHE_ENTRY *p_entries = block_cache.p_entries;
+                            /* Points to the block cache entries      */
+   int         entry;       /* Block cache entry being freed          */
+
+   if (block_cache.eviction_policy == LRU_EVICTION)
+      entry = block_cache.least_recent;
+   else
+   {
+      for (entry = block_cache.clock_hand;
+           p_entries[entry].referenced == TRUE;
+           entry = (entry + 1) % block_cache.capacity)
+         p_entries[entry].referenced = FALSE;
+      block_cache.clock_hand = (entry + 1) % block_cache.capacity;
+   }
+
+   /* Drop the block the entry held                                   */
+   if (p_entries[entry].block_number != 0)
+   {
+      block_cache.p_entry_of_block[p_entries[entry].block_number] =
+         NO_ENTRY;
+      block_cache.eviction_count += 1;
+   }
+   return entry;
+}
+
+/**********************************************************************/
+/*   Determines if a write to a block is waiting in a drive's request */
+/*  queue, or in its inbox on the way to the queue. A write of more   */
+/*  than a block, queued at one of the blocks before, counts as well  */
+/**********************************************************************/
+int block_write_pending(DRIVE *p_drive, int drive_block)
+{
+   REQUEST_QUEUE *p_queue = p_drive->p_queue;
+                          /* Points to the drive's request queue      */
+   REQUEST *p_first,      /* Points to a block's oldest request       */
+           *p_request;    /* Points to one of the block's requests    */
+   int     slot,          /* A busy slot at or before the block       */
+           first_slot = drive_block - geometry.blocks_per_cylinder + 1;
+                          /* First slot a write reaching the block    */
+                          /* could start at                           */
+
+   for (slot = find_busy_slot_below(p_queue, drive_block);
+        slot >= first_slot && slot >= MIN_BLOCK_NUMBER;
+        slot = find_busy_slot_below(p_queue, slot - 1))
+   {
+      p_first = p_request = p_queue->p_slot[slot];
+      do
+      {
+         if (p_request->operation_code == WRITE_OP_CODE &&
+             slot + (p_request->block_size - 1) / BYTES_PER_BLOCK >=
+                                                           drive_block)
+            return TRUE;
+         p_request = p_request->p_next_request;
+      }
+      while (p_request != p_first);
+   }
+   for (p_request = p_drive->p_inbox; p_request != NULL;
+        p_request = p_request->p_next_request)
+      if (p_request->operation_code == WRITE_OP_CODE &&
+          p_request->drive_block <= drive_block &&
+          p_request->drive_block +
+             (p_request->block_size - 1) / BYTES_PER_BLOCK >=
+                                                           drive_block)
+         return TRUE;
+   return FALSE;
+}
+
+/**********************************************************************/
+/*  Determines if a read continues one of the sequential streams the  */
+/*   driver is following, starting a new stream in place of the one   */
+/*                     read least recently if not                     */
+/**********************************************************************/
+int detect_stream(int block_number)
+{
+   READ_STREAM *p_stream = read_ahead.streams,
+                         /* Points to a stream                        */
+               *p_oldest = read_ahead.streams;
+                         /* Points to the least recently read stream  */
+   int         stream;   /* Index of a stream                         */
+
+   /* Look for the stream this block continues                        */
+   read_ahead.read_count += 1;
+   for (stream = 0; stream < READ_STREAMS; stream++)
+   {
+      p_stream = &read_ahead.streams[stream];
+      if (p_stream->next_block == block_number)
+         break;
+      if (p_stream->last_use < p_oldest->last_use)
+         p_oldest = p_stream;
+   }
+
+   /* Start a new stream if the block continues none of them          */
+   if (stream == READ_STREAMS)
+   {
+      p_stream         = p_oldest;
+      p_stream->length = 0;
+   }
+   p_stream->next_block = block_number + 1;
+   p_stream->length    += 1;
+   p_stream->last_use   = read_ahead.read_count;
+   return p_stream->length >= SEQUENTIAL_LENGTH;
+}
+
+/**********************************************************************/
+/*  Serves a read from a track buffer of its drive if one holds its   */
+/*   block, growing the read-ahead window if the block was read ahead */
+/**********************************************************************/
+int read_buffered_block(REQUEST *p_request)
+{
+   TRACK_BUFFER *p_buffers = p_request->p_drive->buffers,
+                           /* Points to the drive's track buffers     */
+                *p_buffer; /* Points to a track buffer                */
+   int          index;     /* Index of the block in the buffer        */
+
+   for (p_buffer = p_buffers; p_buffer < p_buffers + TRACK_BUFFERS;
+        p_buffer++)
+   {
+      index = p_request->drive_block - p_buffer->first_block;
+      if (index >= 0 && index < p_buffer->block_count &&
+          p_buffer->p_block_state[index] != BUFFER_EMPTY)
+      {
+         if (p_buffer->p_block_state[index] == BUFFER_PREFETCHED)
+         {
+            p_buffer->p_block_state[index] = BUFFER_READ;
+            read_ahead.useful_count     += 1;
+            if (read_ahead.window < read_ahead.max_window)
+               read_ahead.window += 1;
+         }
+         memcpy(p_request->p_data_address,
+                (char *)p_buffer->p_data + index * BYTES_PER_BLOCK,
+                BYTES_PER_BLOCK);
+         complete_request(p_request, 0);
+         p_buffer->last_use    = read_ahead.read_count;
+         read_ahead.hit_count += 1;
+         return TRUE;
+      }
+   }
+   return FALSE;
+}
+
+/**********************************************************************/
+/*  Drops the blocks a write changes from its drive's track buffers   */
+/**********************************************************************/
+void drop_buffered_blocks(DRIVE *p_drive, int drive_block,
+                          int block_size)
+{
+   TRACK_BUFFER *p_buffer; /* Points to a track buffer                */
+   int          index,     /* Index of a block in the buffer          */
+                last;      /* Index of the last block the write       */
+                           /* changes                                 */
+
+   for (p_buffer = p_drive->buffers;
+        p_buffer < p_drive->buffers + TRACK_BUFFERS; p_buffer++)
+   {
+      index = drive_block - p_buffer->first_block;
+      last  = index + (block_size - 1) / BYTES_PER_BLOCK;
+      for (; index <= last; index++)
+         if (index >= 0 && index < p_buffer->block_count)
+         {
+            if (p_buffer->p_block_state[index] == BUFFER_PREFETCHED)
+               read_ahead.wasted_count += 1;
+            p_buffer->p_block_state[index] = BUFFER_EMPTY;
+         }
+   }
+   return;
+}
+
+/**********************************************************************/
+/*    Empties a drive's least recently used track buffer for a        */
+/*  transfer, shrinking the read-ahead window if it held read ahead   */
+/*                     blocks that were never used                    */
+/**********************************************************************/
+TRACK_BUFFER *take_track_buffer(DRIVE *p_drive)
+{
+   TRACK_BUFFER *p_oldest = p_drive->buffers,
+                           /* Points to least recently used buffer    */
+                *p_buffer; /* Points to a track buffer                */
+   int          index,     /* Index of a block in the buffer          */
+                wasted = 0;/* Read ahead blocks never used            */
+
+   for (p_buffer = p_drive->buffers + 1;
+        p_buffer < p_drive->buffers + TRACK_BUFFERS; p_buffer++)
+      if (p_buffer->last_use < p_oldest->last_use)
+         p_oldest = p_buffer;
+   for (index = 0; index < p_oldest->block_count; index++)
+      if (p_oldest->p_block_state[index] == BUFFER_PREFETCHED)
+         wasted += 1;
+   if (wasted > 0)
+   {
+      read_ahead.wasted_count += wasted;
+      read_ahead.window        = (read_ahead.window + 1) / 2;
+   }
+   p_oldest->block_count = 0;
+   return p_oldest;
+}
+
+/**********************************************************************/
+/*   Records the blocks a multiple block transfer left in its track   */
+/*  buffer. A write leaves the buffer empty, and so does a block a    */
+/*          queued write is about to change after a read              */
+/**********************************************************************/
+void fill_track_buffer(TRACK_BUFFER *p_buffer, REQUEST *p_run[],
+                       int run_length)
+{
+   int index; /* Index of a block in the track buffer                 */
+
+   p_buffer->last_use = read_ahead.read_count;
+   if (p_run[0]->operation_code == WRITE_OP_CODE)
+      return;
+   p_buffer->first_block = p_run[0]->drive_block;
+   p_buffer->block_count = run_length;
+   for (index = 0; index < run_length; index++)
+      if (block_write_pending(p_run[0]->p_drive,
+                              p_buffer->first_block + index) == TRUE)
+         p_buffer->p_block_state[index] = BUFFER_EMPTY;
+      else if (p_run[index] == NULL)
+      {
+         p_buffer->p_block_state[index] = BUFFER_PREFETCHED;
+         read_ahead.prefetch_count   += 1;
+      }
+      else
+         p_buffer->p_block_state[index] = BUFFER_READ;
+   return;
+}
+
+/**********************************************************************/
+/*   Gets the time in microseconds. The simulated disk replaces this  */
+/*                    with its own simulated clock                    */
+/**********************************************************************/
+__attribute__((weak)) long long current_time()
+{
+   struct timespec now; /* Monotonic clock reading                    */
+
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/**********************************************************************/
+/*  Waits for a number of microseconds. The simulated disk replaces   */
+/*     this with a wait on the simulated clock of the disk waited on  */
+/**********************************************************************/
+__attribute__((weak)) void wait_microseconds(long long microseconds)
+{
+   struct timespec delay; /* Time to sleep                            */
+
+   delay.tv_sec  = microseconds / 1000000;
+   delay.tv_nsec = microseconds % 1000000 * 1000;
+   while (nanosleep(&delay, &delay) != 0)
+      ;
+   return;
+}
+
+/**********************************************************************/
+/*  Waits out the backoff before a seek or transfer retry, which      */
+/*  doubles with each retry from the first retry's up to the longest  */
+/**********************************************************************/
+void back_off(int retry)
+{
+   long long backoff = retry_policy.backoff;
+                       /* Wait before this retry                      */
+
+   while (retry > 1 && backoff < retry_policy.max_backoff)
+   {
+      backoff *= 2;
+      retry   -= 1;
+   }
+   if (backoff > retry_policy.max_backoff)
+      backoff = retry_policy.max_backoff;
+   if (backoff > 0)
+      wait_microseconds(backoff);
+   return;
+}
+
+/**********************************************************************/
+/*           Sets up the motor power management policy                */
+/**********************************************************************/
+void create_motor_policy(char *p_policy_name)
+{
+   MOTOR_POLICY motor_policy; /* The policy every drive starts with   */
+   int          drive;        /* Index of a drive                     */
+
+   /* Look up the policy, adaptive unless fixed was asked for         */
+   memset(&motor_policy, 0, sizeof(MOTOR_POLICY));
+   if (p_policy_name == NULL || *p_policy_name == '\0' ||
+       strcmp(p_policy_name, "adaptive") == 0)
+      motor_policy.adaptive = TRUE;
+   else if (strcmp(p_policy_name, "fixed") == 0)
+      motor_policy.adaptive = FALSE;
+   else
+   {
+      printf("\nError #%d in create_motor_policy().", MOTOR_POLICY_ERR);
+      printf("\nUnknown motor policy \"%s\".", p_policy_name);
+      printf("\nThe program is aborting.");
+      exit(MOTOR_POLICY_ERR);
+   }
+
+   /* The fixed timeout is also where the adaptive policy starts      */
+   motor_policy.timeout       = get_config_value("DRIVER_SPIN_DOWN_US",
+                                                 0);
+   motor_policy.max_timeout   = get_config_value(
+                                   "DRIVER_MAX_SPIN_DOWN_US", 10000000);
+   motor_policy.idle_start    = NOT_IDLE;
+   motor_policy.history_count = 0;
+   motor_policy.history_next  = 0;
+
+   /* Give each drive its own copy, to adapt to its own idle periods  */
+   for (drive = 0; drive < drive_count; drive++)
+      p_drives[drive].motor_policy = motor_policy;
+   return;
+}
+
+/**********************************************************************/
+/*  Records an idle period that has just ended and, for the adaptive  */
+/*   policy, picks the spin-down timeout that would have cost the     */
+/*  remembered idle periods the least. A period shorter than the      */
+/*  timeout costs its length in idle spinning; a longer one costs the */
+/*    timeout in idle spinning plus the average spin-up latency       */
+/**********************************************************************/
+void end_idle_period(DRIVE *p_drive)
+{
+   MOTOR_POLICY *p_policy = &p_drive->motor_policy;
+                              /* Points to the drive's motor policy   */
+   long long idle_time = current_time() - p_policy->idle_start,
+                              /* Length of the idle period            */
+             spin_up_cost,    /* Average spin-up latency              */
+             timeout,         /* A candidate timeout                  */
+             cost,            /* Cost of the candidate timeout        */
+             best_cost = -1;  /* Cost of the best timeout so far      */
+   int       candidate,       /* History entry giving the candidate   */
+             period;          /* History entry being costed           */
+
+   /* Count the spin-ups the motor policy avoided                     */
+   p_policy->idle_start = NOT_IDLE;
+   if (p_drive->disk_on == TRUE)
+      p_policy->avoided_count += 1;
+   if (p_policy->adaptive == FALSE)
+      return;
+
+   /* Remember the idle period                                        */
+   p_policy->idle_history[p_policy->history_next] = idle_time;
+   p_policy->history_next = (p_policy->history_next + 1) %
+                            IDLE_HISTORY;
+   if (p_policy->history_count < IDLE_HISTORY)
+      p_policy->history_count += 1;
+   if (p_policy->spin_up_count == 0)
+      return;
+   spin_up_cost = p_policy->spin_up_time / p_policy->spin_up_count;
+
+   /* The best timeout is either zero or exactly the length of one of */
+   /* the remembered periods, so only those need to be costed         */
+   for (candidate = -1; candidate < p_policy->history_count;
+        candidate++)
+   {
+      timeout = candidate < 0 ? 0 : p_policy->idle_history[candidate];
+      if (timeout > p_policy->max_timeout)
+         continue;
+      cost = 0;
+      for (period = 0; period < p_policy->history_count; period++)
+         if (p_policy->idle_history[period] <= timeout)
+            cost += p_policy->idle_history[period];
+         else
+            cost += timeout + spin_up_cost;
+      if (best_cost < 0 || cost < best_cost)
+      {
+         best_cost         = cost;
+         p_policy->timeout = timeout;
+      }
+   }
+   return;
+}
+
+/**********************************************************************/
+/*              Determines if a number is a power of two              */
+/**********************************************************************/
+int power_of_two(int input_value)
+{
+   return input_value > 0 && (input_value & (input_value - 1)) == 0;
+}
+
+/**********************************************************************/
+/*  Opens the capture file, if one was asked for, and writes its      */
+/*  header. The file then records every message the file system sends */
+/*  and every disk command with its result, so the workload can be    */
+/*  replayed offline. It is left open for exit() to flush, since a    */
+/*           worker may still be writing to it at exit                */
+/**********************************************************************/
+void create_capture(char *p_name)
+{
+   CAPTURE_HEADER header; /* Header of the capture file               */
+
+   if (p_name == NULL || *p_name == '\0')
+      return;
+   memset(&header, 0, sizeof(CAPTURE_HEADER));
+   memcpy(header.magic, "DRVCAPTR", sizeof(header.magic));
+   header.version     = CAPTURE_VERSION;
+   header.record_size = sizeof(CAPTURE_RECORD);
+   if ((p_capture_file = fopen(p_name, "wb")) == NULL ||
+       fwrite(&header, sizeof(CAPTURE_HEADER), 1, p_capture_file) != 1)
+   {
+      printf("\nError #%d in create_capture().", CAPTURE_ERR);
+      printf("\nCannot open the capture file \"%s\".", p_name);
+      printf("\nThe program is aborting.");
+      exit(CAPTURE_ERR);
+   }
+   return;
+}
+
+/**********************************************************************/
+/*  Writes a message or disk command to the capture file. A message   */
+/*  records the exchange with the file system it came in, so a replay */
+/*  can send each exchange's messages together. Each record is        */
+/*  written whole, so the drives' workers may capture their commands  */
+/*                         at the same time                           */
+/**********************************************************************/
+void capture_event(int kind, int unit, int code, int arg1, int arg2,
+                   int arg3, int result)
+{
+   CAPTURE_RECORD record; /* Record of the event                      */
+
+   memset(&record, 0, sizeof(CAPTURE_RECORD));
+   record.time     = current_time();
+   record.kind     = kind;
+   record.unit     = unit;
+   record.code     = code;
+   record.args[0]  = arg1;
+   record.args[1]  = arg2;
+   record.args[2]  = arg3;
+   record.result   = result;
+   record.exchange = kind == CAPTURE_MESSAGE ? (int)intake_count : -1;
+   fwrite(&record, sizeof(CAPTURE_RECORD), 1, p_capture_file);
+   return;
+}
+
+#ifdef DRIVER_METRICS
+/**********************************************************************/
+/*  Sets up the metrics snapshots, written as text or JSON to their   */
+/*  file every interval and at exit, and the binary trace file, which */
+/*   starts with a header and then holds a record for each request    */
+/*                           as it completes                          */
+/**********************************************************************/
+void create_metrics()
+{
+   char         *p_format        = getenv("DRIVER_METRICS_FORMAT"),
+                                  /* Points to the snapshot format    */
+                *p_snapshot_name = getenv("DRIVER_METRICS_FILE"),
+                                  /* Points to the snapshot file name */
+                *p_trace_name    = getenv("DRIVER_TRACE_FILE");
+                                  /* Points to the trace file name    */
+   TRACE_HEADER header;           /* Header of the trace file         */
+
+   /* Look up the snapshot format, text unless JSON was asked for     */
+   memset(&metrics, 0, sizeof(METRICS));
+   if (p_format == NULL || *p_format == '\0' ||
+       strcmp(p_format, "text") == 0)
+      metrics.json = FALSE;
+   else if (strcmp(p_format, "json") == 0)
+      metrics.json = TRUE;
+   else
+   {
+      printf("\nError #%d in create_metrics().", METRICS_ERR);
+      printf("\nUnknown metrics format \"%s\".", p_format);
+      printf("\nThe program is aborting.");
+      exit(METRICS_ERR);
+   }
+   metrics.interval      =
+      get_config_value("DRIVER_METRICS_INTERVAL_US", 1000000);
+   metrics.next_snapshot = current_time() + metrics.interval;
+
+   /* Open the files that were asked for                              */
+   if (p_snapshot_name != NULL && *p_snapshot_name != '\0' &&
+       (metrics.p_snapshot_file = fopen(p_snapshot_name, "w")) == NULL)
+   {
+      printf("\nError #%d in create_metrics().", METRICS_ERR);
+      printf("\nCannot open the metrics file \"%s\".", p_snapshot_name);
+      printf("\nThe program is aborting.");
+      exit(METRICS_ERR);
+   }
+   if (p_trace_name != NULL && *p_trace_name != '\0')
+   {
+      memset(&header, 0, sizeof(TRACE_HEADER));
+      memcpy(header.magic, "DRVTRACE", sizeof(header.magic));
+      header.version     = TRACE_VERSION;
+      header.record_size = sizeof(TRACE_RECORD);
+      if ((metrics.p_trace_file = fopen(p_trace_name, "wb")) == NULL ||
+          fwrite(&header, sizeof(TRACE_HEADER), 1,
+                 metrics.p_trace_file) != 1)
+      {
+         printf("\nError #%d in create_metrics().", METRICS_ERR);
+         printf("\nCannot open the trace file \"%s\".", p_trace_name);
+         printf("\nThe program is aborting.");
+         exit(METRICS_ERR);
+      }
+   }
+   atexit(finish_metrics);
+   return;
+}
+
+/**********************************************************************/
+/*   Adds a value to a histogram, in the bucket of its highest set    */
+/*                                bit                                 */
+/**********************************************************************/
+void record_value(HISTOGRAM *p_histogram, long long value)
+{
+   int bucket = 0; /* Bucket the value falls in                       */
+
+   if (value > 0)
+      bucket = BITS_PER_WORD - __builtin_clzll(value);
+   if (bucket >= HISTOGRAM_BUCKETS)
+      bucket = HISTOGRAM_BUCKETS - 1;
+   p_histogram->count           += 1;
+   p_histogram->buckets[bucket] += 1;
+   p_histogram->total           += value;
+   if (value > p_histogram->maximum)
+      p_histogram->maximum = value;
+   return;
+}
+
+/**********************************************************************/
+/*   Records a completed request's latency, and its service time if   */
+/*  it was served by a transfer, and writes its trace record if there */
+/*                          is a trace file                           */
+/**********************************************************************/
+void record_completion(REQUEST *p_request)
+{
+   long long    *p_times = p_request->event_times;
+                           /* Points to the request's lifecycle times */
+   TRACE_RECORD record;    /* Trace record of the request             */
+
+   metrics.last_time = p_times[COMPLETION_EVENT];
+   record_value(&metrics.latency,
+                p_times[COMPLETION_EVENT] - p_times[ARRIVAL_EVENT]);
+   if (p_times[DISPATCH_EVENT] >= 0)
+      record_value(&metrics.service,
+                   p_times[COMPLETION_EVENT] - p_times[DISPATCH_EVENT]);
+   if (metrics.p_trace_file != NULL)
+   {
+      record.request_number  = p_request->request_number;
+      record.block_number    = p_request->block_number;
+      record.operation_code  = p_request->operation_code;
+      record.error_code      = p_request->error_code;
+      record.unit            = -1;
+      record.cylinder_number = -1;
+      if (p_request->p_drive != NULL)
+      {
+         record.unit            = p_request->p_drive->unit;
+         record.cylinder_number = p_request->cylinder_number;
+      }
+      memcpy(record.event_times, p_times, sizeof(record.event_times));
+      fwrite(&record, sizeof(TRACE_RECORD), 1, metrics.p_trace_file);
+   }
+   return;
+}
+
+/**********************************************************************/
+/*  Writes a metrics snapshot if there is a metrics file and the      */
+/*  interval has passed. The time is taken from the completions, so   */
+/*          no clock is read while the snapshot is not due            */
+/**********************************************************************/
+void take_metrics_snapshot()
+{
+   if (metrics.p_snapshot_file != NULL &&
+       metrics.last_time >= metrics.next_snapshot)
+   {
+      write_metrics(metrics.p_snapshot_file, metrics.json);
+      metrics.next_snapshot = metrics.last_time + metrics.interval;
+   }
+   return;
+}
+
+/**********************************************************************/
+/*   Writes a snapshot of the driver metrics, as a block of text or   */
+/*                       as one line of JSON                          */
+/**********************************************************************/
+void write_metrics(FILE *p_file, int json)
+{
+   DRIVE *p_drive; /* Points to a drive                               */
+
+   if (json == TRUE)
+      fprintf(p_file, "{\"time_us\":%lld,\"drives\":[",
+              metrics.last_time);
+   else
+      fprintf(p_file, "Metrics at %.3f ms\n",
+              metrics.last_time / 1000.0);
+   for (p_drive = p_drives; p_drive < p_drives + drive_count;
+        p_drive++)
+      if (json == TRUE)
+         fprintf(p_file, "%s{\"unit\":%d,\"seek_distance\":%ld,"
+                         "\"recalibrations\":%ld,\"transfers\":%ld,"
+                         "\"checksum_retries\":%ld,\"spin_ups\":%ld}",
+                 p_drive == p_drives ? "" : ",", p_drive->unit,
+                 p_drive->seek_distance, p_drive->recalibrate_count,
+                 p_drive->transfer_count, p_drive->checksum_retry_count,
+                 p_drive->motor_policy.spin_up_count);
+      else
+         fprintf(p_file, "Drive %d: %ld cylinders of seek distance, %ld"
+                         " recalibrations, %ld transfers, %ld checksum"
+                         " retries, %ld spin-ups\n",
+                 p_drive->unit, p_drive->seek_distance,
+                 p_drive->recalibrate_count, p_drive->transfer_count,
+                 p_drive->checksum_retry_count,
+                 p_drive->motor_policy.spin_up_count);
+   if (json == TRUE)
+      fprintf(p_file, "]");
+   write_histogram(p_file, "latency_us", &metrics.latency, json);
+   write_histogram(p_file, "service_us", &metrics.service, json);
+   write_histogram(p_file, "seek_cylinders", &metrics.seek, json);
+   write_histogram(p_file, "queue_depth", &metrics.queue_depth, json);
+   if (json == TRUE)
+      fprintf(p_file, "}\n");
+   fflush(p_file);
+   return;
+}
+
+/**********************************************************************/
+/*  Writes one histogram of a metrics snapshot. JSON lists every      */
+/*  bucket, and text only the buckets holding values, each with the   */
+/*                     range of values it holds                       */
+/**********************************************************************/
+void write_histogram(FILE *p_file, char *p_name,
+                     HISTOGRAM *p_histogram, int json)
+{
+   int bucket; /* Index of a histogram bucket                         */
+
+   if (json == TRUE)
+   {
+      fprintf(p_file, ",\"%s\":{\"count\":%ld,\"total\":%lld,"
+                      "\"max\":%lld,\"buckets\":[",
+              p_name, p_histogram->count, p_histogram->total,
+              p_histogram->maximum);
+      for (bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+         fprintf(p_file, "%s%ld", bucket == 0 ? "" : ",",
+                 p_histogram->buckets[bucket]);
+      fprintf(p_file, "]}");
+      return;
+   }
+   fprintf(p_file, "%s: %ld values, %.3f mean, %lld max", p_name,
+           p_histogram->count,
+           p_histogram->count > 0 ?
+              (double)p_histogram->total / p_histogram->count : 0.0,
+           p_histogram->maximum);
+   for (bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+      if (p_histogram->buckets[bucket] > 0)
+      {
+         if (bucket <= 1)
+            fprintf(p_file, ", %d", bucket);
+         else if (bucket == HISTOGRAM_BUCKETS - 1)
+            fprintf(p_file, ", %lld+", 1LL << (bucket - 1));
+         else
+            fprintf(p_file, ", %lld-%lld", 1LL << (bucket - 1),
+                    (1LL << bucket) - 1);
+         fprintf(p_file, ": %ld", p_histogram->buckets[bucket]);
+      }
+   fprintf(p_file, "\n");
+   return;
+}
+
+/**********************************************************************/
+/*  Writes the last metrics snapshot. The metrics and trace files are */
+/*  left open for exit() to flush, since a worker may still be        */
+/*                    completing a request at exit                    */
+/**********************************************************************/
+void finish_metrics()
+{
+   if (metrics.p_snapshot_file != NULL)
+      write_metrics(metrics.p_snapshot_file, metrics.json);
+   return;
 }
+#endif